@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) 2015 Massachusetts Institute of Technology
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <sys/resource.h>
+#include "ns3/core-module.h"
+#include "ns3/network-module.h"
+#include "ns3/olsr-module.h"
+#include "ns3/mobility-module.h"
+#include "ns3/applications-module.h"
+#include "ns3/internet-module.h"
+#include "ns3/simple-wireless-module.h"
+
+
+// This file is used to measure the heap allocations and the peak memory
+// of a large OLSR run, for example to compare the shared receive packet
+// with a build that copies the packet for every receiver.
+//
+// The scenario has the following:
+//  - 1000 nodes (--nodes)
+//  - nodes are randomly placed in a 2000 x 2000 meter square
+//  - NO mobility
+//  - simple wireless model has:
+//         + tx range of 250
+//         + NO error model
+//         + NO queue
+//  - OLSR used for routing
+//  - On/Off application used for node 0 to broadcast 100Kb/s
+//
+// Every operator new is counted. The counts before and after
+// Simulator::Run are printed with the peak resident set size of the
+// process. Run the same command line on both builds and compare the
+// "Run" lines, for example:
+//
+//    ./waf --run "packet_memory_test --nodes=1000 --simtime=30"
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("packet_memory_test");
+
+// Allocation counters. Plain globals so that operator new can update
+// them before anything else is constructed.
+static uint64_t g_allocations = 0;
+static uint64_t g_allocatedBytes = 0;
+
+#if __cplusplus >= 201103L
+#define NEW_THROW_SPEC
+#else
+#define NEW_THROW_SPEC throw (std::bad_alloc)
+#endif
+
+void *
+operator new (std::size_t size) NEW_THROW_SPEC
+{
+  g_allocations++;
+  g_allocatedBytes += size;
+  void *p = std::malloc (size ? size : 1);
+  if (p == 0)
+  {
+    throw std::bad_alloc ();
+  }
+  return p;
+}
+
+void *
+operator new[] (std::size_t size) NEW_THROW_SPEC
+{
+  return operator new (size);
+}
+
+void
+operator delete (void *p) throw ()
+{
+  std::free (p);
+}
+
+void
+operator delete[] (void *p) throw ()
+{
+  std::free (p);
+}
+
+uint64_t pkts_rcvd = 0;
+
+static void MacRxSuccess (Ptr<const Packet> p)
+{
+  pkts_rcvd++;
+}
+
+// Peak resident set size of the process in kilobytes
+static long PeakMemory (void)
+{
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+
+// ******************************************************************
+// MAIN
+// ******************************************************************
+
+int
+main (int argc, char *argv[])
+{
+	NodeContainer::Iterator it;
+
+	// ***********************************************************************
+	// Initialize all value that are to be used in the scenario
+	// ***********************************************************************
+	uint32_t numNodes = 1000;
+	double simtime = 30;
+	double range = 250;
+	double dataRate = 1000000.0;
+
+	// ***********************************************************************
+	// parse command line
+	// ***********************************************************************
+	CommandLine cmd;
+	cmd.AddValue ("nodes", "Number of nodes", numNodes);
+	cmd.AddValue ("simtime", "Simulation time (seconds)", simtime);
+	cmd.AddValue ("range", "Transmission range (meters)", range);
+	cmd.Parse (argc,argv);
+
+	std::cout << "Running scenario with " << numNodes << " nodes for " << simtime << " seconds" << std::endl;
+
+	// ***********************************************************************
+	// Create all the nodes
+	// ***********************************************************************
+	NodeContainer myNodes;
+	myNodes.Create (numNodes);
+
+	// Create container to hold devices
+	NetDeviceContainer devices;
+
+	// ***********************************************************************
+	// Set up the physical/radio layer
+	// ***********************************************************************
+	Config::SetDefault ("ns3::SimpleWirelessChannel::MaxRange", DoubleValue (range));
+	Ptr<SimpleWirelessChannel> phy = CreateObject<SimpleWirelessChannel> ();
+	phy->setErrorModelType (CONSTANT);
+	phy->setErrorRate (0.0);
+
+	// create simple wireless device on each node
+	for (it = myNodes.Begin (); it != myNodes.End (); ++it)
+	{
+		Ptr<Node> node = *it;
+
+		Ptr<SimpleWirelessNetDevice> simpleWireless = CreateObject<SimpleWirelessNetDevice> ();
+		simpleWireless->SetChannel(phy);
+		simpleWireless->SetNode(node);
+		simpleWireless->SetAddress(Mac48Address::Allocate ());
+		simpleWireless->SetDataRate((DataRate (dataRate)));
+		simpleWireless->TraceConnectWithoutContext ("MacRx", MakeCallback (&MacRxSuccess));
+
+		node->AddDevice (simpleWireless);
+		devices.Add (simpleWireless);
+	}
+
+	// ***********************************************************************
+	// Place the nodes.
+	// ***********************************************************************
+	MobilityHelper mobility;
+	mobility.SetPositionAllocator ("ns3::RandomRectanglePositionAllocator",
+	                               "X", StringValue ("ns3::UniformRandomVariable[Min=0.0|Max=2000.0]"),
+	                               "Y", StringValue ("ns3::UniformRandomVariable[Min=0.0|Max=2000.0]"));
+	mobility.SetMobilityModel ("ns3::ConstantPositionMobilityModel");
+	mobility.Install (myNodes);
+
+	// ***********************************************************************
+	// Set up routing OLSR
+	// ***********************************************************************
+	InternetStackHelper stack;
+	OlsrHelper olsr;
+	stack.SetRoutingHelper (olsr);
+	stack.Install (myNodes);
+
+	Ipv4AddressHelper address;
+	address.SetBase ("10.0.0.0", "255.255.0.0");
+	address.Assign (devices);
+
+	// ***********************************************************************
+	// Set up application
+	// ***********************************************************************
+	OnOffHelper onoff = OnOffHelper ("ns3::UdpSocketFactory", InetSocketAddress (Ipv4Address ("255.255.255.255"), 8080));
+	onoff.SetAttribute ("PacketSize", StringValue ("1000"));
+	onoff.SetAttribute ("DataRate", StringValue ("100000"));
+	onoff.SetAttribute ("OnTime", StringValue ("ns3::ConstantRandomVariable[Constant=1]"));
+	onoff.SetAttribute ("OffTime", StringValue ("ns3::ConstantRandomVariable[Constant=0]"));
+	ApplicationContainer apps = onoff.Install (myNodes.Get (0));
+	apps.Start (Seconds (5.0));
+	apps.Stop (Seconds (simtime - 1.0));
+
+	// ***********************************************************************
+	// and finally ... off we go!
+	// ***********************************************************************
+	uint64_t setupAllocations = g_allocations;
+	uint64_t setupBytes = g_allocatedBytes;
+	long setupPeak = PeakMemory ();
+
+	Simulator::Stop (Seconds(simtime));
+	Simulator::Run ();
+
+	uint64_t runAllocations = g_allocations - setupAllocations;
+	uint64_t runBytes = g_allocatedBytes - setupBytes;
+	long runPeak = PeakMemory ();
+
+	Simulator::Destroy ();
+
+	std::cout << "MacRx Count: " << pkts_rcvd << std::endl;
+	std::cout << "Setup: allocations " << setupAllocations << " bytes " << setupBytes
+	          << " peak memory (kB) " << setupPeak << std::endl;
+	std::cout << "Run: allocations " << runAllocations << " bytes " << runBytes
+	          << " peak memory (kB) " << runPeak << std::endl;
+
+	NS_LOG_INFO ("Run Completed Successfully");
+
+	return 0;
+}
@@ -0,0 +1,617 @@
+/*
+ * Copyright (C) 2015 Massachusetts Institute of Technology
+ * All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "ns3/core-module.h"
+#include "ns3/network-module.h"
+#include "ns3/mobility-module.h"
+#include "ns3/simple-wireless-module.h"
+
+
+// This file is used to check that the spatial indexes and the other
+// send and delivery options of the channel deliver the same packets as
+// the default full scan of all devices.
+//
+// The scenario has the following:
+//  - 150 nodes placed at random in a 600 x 600 x 50 meter box
+//  - optionally half the nodes moving at up to 10 m/s, with course
+//    changes, a jump (SetPosition) and one node faster than MaxNodeSpeed
+//  - simple wireless model has:
+//         + tx range of 150, every fourth device has a MaxRange of 100
+//         + a drop tail queue
+//         + a receive error model that drops packets by size
+//  - no IP stack. Frames are sent straight to the devices, 70% broadcast
+//    and 30% unicast, at times taken from a fixed sequence
+//
+// Each group of runs uses one scenario and error model. The first run of
+// a group uses the full scan and the other runs must deliver the same set
+// of (arrival time, receiver, sender, size). The error draws only give the
+// same results when the links are drawn in the same order or with
+// PerLinkErrorStreams, so the groups are set up that way. PositionRefreshInterval
+// and the PER table resolution change the results by design and are not
+// checked.
+//
+// Directional sends can not be compared with a full scan, so their
+// receivers are checked against the neighbors in range computed from
+// the node positions.
+//
+// The program prints one line per run and exits with 1 if any run does
+// not match.
+
+using namespace ns3;
+
+NS_LOG_COMPONENT_DEFINE ("spatial_index_test");
+
+#define NUM_NODES 150
+#define NUM_FRAMES 400
+#define TX_RANGE 150.0
+#define SHORT_RANGE 100.0
+#define PROTOCOL 0x88B5
+
+// ******************************************************************
+// Receive error model that drops every packet whose size is a multiple
+// of nine. Unlike a random error model it gives the same result no
+// matter when or in what order the packets are checked.
+// ******************************************************************
+class SizeErrorModel : public ErrorModel
+{
+public:
+  static TypeId GetTypeId (void)
+  {
+    static TypeId tid = TypeId ("SizeErrorModel")
+      .SetParent<ErrorModel> ()
+      .AddConstructor<SizeErrorModel> ()
+      ;
+    return tid;
+  }
+
+private:
+  virtual bool DoCorrupt (Ptr<Packet> p)
+  {
+    return (p->GetSize () % 9) == 0;
+  }
+  virtual void DoReset (void)
+  {
+  }
+};
+
+// One delivered packet
+struct Reception
+{
+  int64_t time;
+  uint32_t receiver;
+  uint32_t sender;
+  uint32_t size;
+
+  bool operator< (const Reception &other) const
+  {
+    if (time != other.time)
+      return time < other.time;
+    if (receiver != other.receiver)
+      return receiver < other.receiver;
+    if (sender != other.sender)
+      return sender < other.sender;
+    return size < other.size;
+  }
+  bool operator== (const Reception &other) const
+  {
+    return (time == other.time) && (receiver == other.receiver) &&
+           (sender == other.sender) && (size == other.size);
+  }
+};
+
+// Channel and device settings of one run
+struct Variant
+{
+  const char *name;
+  SpatialIndexType spatialIndex;
+  bool staticTopology;
+  bool directUnicast;
+  bool batchedDelivery;
+  bool earlyReceiveDrop;
+  uint32_t receiverThreads;
+  bool macAddressTag;
+  double octreeSlack;
+  StochasticStorageType storage;
+};
+
+// Scenario and error model shared by the runs of a group
+struct Group
+{
+  const char *name;
+  bool mobile;
+  bool contention;
+  ErrorModelType errorModel;
+  double errorRate;
+  bool perLinkErrorStreams;
+  std::vector<Variant> variants;
+};
+
+// A frame sent by the traffic sequence. A dest of -1 is a broadcast.
+struct Sent
+{
+  uint32_t sender;
+  uint32_t size;
+  int32_t dest;
+};
+
+std::vector<Reception> receptions;
+std::map<Mac48Address, uint32_t> nodeByAddress;
+
+// ******************************************************************
+// Fixed sequence of random values so every run sees the same scenario
+// ******************************************************************
+static uint32_t lcgState;
+
+static double NextRandom (void)
+{
+  lcgState = lcgState * 1664525 + 1013904223;
+  return lcgState / 4294967296.0;
+}
+
+static bool ReceivePacket (Ptr<NetDevice> device, Ptr<const Packet> p, uint16_t protocol, const Address &from)
+{
+  Reception r;
+  r.time = Simulator::Now ().GetNanoSeconds ();
+  r.receiver = device->GetNode ()->GetId ();
+  r.sender = nodeByAddress[Mac48Address::ConvertFrom (from)];
+  r.size = p->GetSize ();
+  receptions.push_back (r);
+  return true;
+}
+
+static void SendFrame (Ptr<NetDevice> device, uint32_t size, Address to)
+{
+  device->Send (Create<Packet> (size), to, PROTOCOL);
+}
+
+// ******************************************************************
+// Build the nodes, devices, mobility and traffic of the scenario
+// ******************************************************************
+static NetDeviceContainer
+BuildScenario (Ptr<SimpleWirelessChannel> phy, bool mobile, bool macAddressTag, bool directional)
+{
+	NetDeviceContainer devices;
+	NodeContainer nodes;
+	nodes.Create (NUM_NODES);
+	nodeByAddress.clear ();
+	lcgState = 12345;
+
+	for (uint32_t id = 0; id < NUM_NODES; ++id)
+	{
+		Ptr<Node> node = nodes.Get (id);
+		Vector position;
+		position.x = NextRandom () * 600;
+		position.y = NextRandom () * 600;
+		position.z = NextRandom () * 50;
+		Vector velocity (0, 0, 0);
+		if (mobile && (id % 2 == 0))
+		{
+			velocity.x = NextRandom () * 14 - 7;
+			velocity.y = NextRandom () * 14 - 7;
+		}
+		if (mobile && (id == 2))
+		{
+			// faster than MaxNodeSpeed
+			velocity = Vector (25, 0, 0);
+		}
+		Ptr<ConstantVelocityMobilityModel> mob = CreateObject<ConstantVelocityMobilityModel> ();
+		mob->SetPosition (position);
+		mob->SetVelocity (velocity);
+		node->AggregateObject (mob);
+
+		if (mobile && (id % 10 == 0))
+		{
+			// course change
+			Vector course (0, 0, 0);
+			course.x = NextRandom () * 14 - 7;
+			course.y = NextRandom () * 14 - 7;
+			Simulator::Schedule (Seconds (7.0 + id * 0.01), &ConstantVelocityMobilityModel::SetVelocity, mob, course);
+		}
+		if (mobile && (id == 5))
+		{
+			// jump
+			Simulator::Schedule (Seconds (12.0), &MobilityModel::SetPosition, mob, Vector (300, 300, 10));
+		}
+
+		Ptr<SimpleWirelessNetDevice> simpleWireless = CreateObject<SimpleWirelessNetDevice> ();
+		simpleWireless->SetChannel (phy);
+		simpleWireless->SetNode (node);
+		Mac48Address address = Mac48Address::Allocate ();
+		simpleWireless->SetAddress (address);
+		simpleWireless->SetDataRate (DataRate (1000000.0));
+		simpleWireless->SetReceiveErrorModel (CreateObject<SizeErrorModel> ());
+		if (id % 4 == 3)
+		{
+			simpleWireless->SetAttribute ("MaxRange", DoubleValue (SHORT_RANGE));
+		}
+		simpleWireless->SetAttribute ("MacAddressTagEnabled", BooleanValue (macAddressTag));
+		simpleWireless->SetAttribute ("FixedNeighborListEnabled", BooleanValue (directional));
+		Ptr<DropTailQueue> queue = CreateObject<DropTailQueue> ();
+		queue->SetAttribute ("MaxPackets", UintegerValue (1000));
+		simpleWireless->SetQueue (queue);
+
+		node->AddDevice (simpleWireless);
+		simpleWireless->SetReceiveCallback (MakeCallback (&ReceivePacket));
+		devices.Add (simpleWireless);
+		nodeByAddress[address] = id;
+	}
+
+	// traffic
+	for (uint32_t frame = 0; frame < NUM_FRAMES; ++frame)
+	{
+		double time = 1.0 + frame * 0.05 + NextRandom () * 0.04;
+		uint32_t sender = static_cast<uint32_t> (NextRandom () * NUM_NODES);
+		uint32_t size = 100 + frame;
+		Address to = Mac48Address::GetBroadcast ();
+		if (NextRandom () < 0.3)
+		{
+			uint32_t dest = static_cast<uint32_t> (NextRandom () * NUM_NODES);
+			to = devices.Get (dest)->GetAddress ();
+		}
+		Simulator::ScheduleWithContext (sender, Seconds (time), &SendFrame, devices.Get (sender), size, to);
+	}
+	return devices;
+}
+
+// ******************************************************************
+// Run one variant of a group and return the sorted receptions
+// ******************************************************************
+static std::vector<Reception>
+RunVariant (const Group &group, const Variant &variant)
+{
+	receptions.clear ();
+
+	Ptr<SimpleWirelessChannel> phy = CreateObject<SimpleWirelessChannel> ();
+	phy->SetAttribute ("MaxRange", DoubleValue (TX_RANGE));
+	phy->setErrorModelType (group.errorModel);
+	phy->setErrorRate (group.errorRate);
+	phy->SetAttribute ("PerLinkErrorStreams", BooleanValue (group.perLinkErrorStreams));
+	phy->SetAttribute ("AvgLinkUpDuration", TimeValue (MilliSeconds (500)));
+	phy->SetAttribute ("AvgLinkDownDuration", TimeValue (MilliSeconds (100)));
+	phy->SetAttribute ("StochasticLinkStorage", EnumValue (variant.storage));
+	phy->SetAttribute ("SpatialIndex", EnumValue (variant.spatialIndex));
+	phy->SetAttribute ("MaxNodeSpeed", DoubleValue (15.0));
+	phy->SetAttribute ("OctreeSlack", DoubleValue (variant.octreeSlack));
+	phy->SetAttribute ("StaticTopology", BooleanValue (variant.staticTopology));
+	phy->SetAttribute ("DirectUnicast", BooleanValue (variant.directUnicast));
+	phy->SetAttribute ("BatchedDelivery", BooleanValue (variant.batchedDelivery));
+	phy->SetAttribute ("EarlyReceiveDrop", BooleanValue (variant.earlyReceiveDrop));
+	phy->SetAttribute ("ReceiverThreads", UintegerValue (variant.receiverThreads));
+	phy->SetAttribute ("ReceiverThreadsMinDevices", UintegerValue (1));
+	phy->AssignStreams (0);
+
+	BuildScenario (phy, group.mobile, variant.macAddressTag, false);
+
+	if (group.contention)
+	{
+		phy->SetAttribute ("FixedContentionRange", DoubleValue (TX_RANGE));
+		phy->SetAttribute ("ContentionUpdateInterval", TimeValue (Seconds (1.0)));
+		phy->EnableFixedContention ();
+	}
+	phy->InitStochasticModel ();
+
+	Simulator::Stop (Seconds (25.0));
+	Simulator::Run ();
+	Simulator::Destroy ();
+
+	std::sort (receptions.begin (), receptions.end ());
+	return receptions;
+}
+
+static bool
+Compare (const char *group, const char *name, const std::vector<Reception> &expected, const std::vector<Reception> &actual)
+{
+	bool same = (expected.size () == actual.size ()) && std::equal (expected.begin (), expected.end (), actual.begin ());
+	std::cout << group << " / " << name << ": " << actual.size () << " receptions "
+	          << (same ? "MATCH" : "MISMATCH") << std::endl;
+	if (!same)
+	{
+		for (uint32_t i = 0; i < std::max (expected.size (), actual.size ()); ++i)
+		{
+			if ((i >= expected.size ()) || (i >= actual.size ()) || !(expected[i] == actual[i]))
+			{
+				if (i < expected.size ())
+				{
+					std::cout << "   expected " << expected[i].time << " ns node " << expected[i].sender
+					          << " -> node " << expected[i].receiver << " size " << expected[i].size << std::endl;
+				}
+				if (i < actual.size ())
+				{
+					std::cout << "   got      " << actual[i].time << " ns node " << actual[i].sender
+					          << " -> node " << actual[i].receiver << " size " << actual[i].size << std::endl;
+				}
+				break;
+			}
+		}
+	}
+	return same;
+}
+
+// ******************************************************************
+// Directional sends. Every node has a few directional neighbors, some
+// out of range. A broadcast must reach each neighbor in range once and
+// a unicast only the neighbor it is for.
+// ******************************************************************
+static bool
+RunDirectional (SpatialIndexType spatialIndex, const char *name)
+{
+	receptions.clear ();
+
+	Ptr<SimpleWirelessChannel> phy = CreateObject<SimpleWirelessChannel> ();
+	phy->SetAttribute ("MaxRange", DoubleValue (TX_RANGE));
+	phy->setErrorModelType (CONSTANT);
+	phy->setErrorRate (0.0);
+	phy->SetAttribute ("SpatialIndex", EnumValue (spatialIndex));
+	phy->AssignStreams (0);
+
+	NetDeviceContainer devices = BuildScenario (phy, false, false, true);
+
+	// positions and ranges
+	std::vector<Vector> positions;
+	std::vector<double> ranges;
+	for (uint32_t id = 0; id < NUM_NODES; ++id)
+	{
+		positions.push_back (devices.Get (id)->GetNode ()->GetObject<MobilityModel> ()->GetPosition ());
+		ranges.push_back ((id % 4 == 3) ? SHORT_RANGE : TX_RANGE);
+	}
+
+	// neighbors
+	std::vector<std::set<uint32_t> > neighbors (NUM_NODES);
+	for (uint32_t id = 0; id < NUM_NODES; ++id)
+	{
+		Ptr<SimpleWirelessNetDevice> dev = DynamicCast<SimpleWirelessNetDevice> (devices.Get (id));
+		for (uint32_t k = 0; k < 5; ++k)
+		{
+			uint32_t nbr = static_cast<uint32_t> (NextRandom () * NUM_NODES);
+			if ((nbr != id) && neighbors[id].insert (nbr).second)
+			{
+				dev->AddDirectionalNeighbor (nbr, Mac48Address::ConvertFrom (devices.Get (nbr)->GetAddress ()));
+			}
+		}
+	}
+
+	// the frames sent, read back from the traffic sequence
+	std::vector<Sent> sent;
+	lcgState = 12345;
+	for (uint32_t id = 0; id < NUM_NODES; ++id)
+	{
+		NextRandom ();
+		NextRandom ();
+		NextRandom ();
+	}
+	for (uint32_t frame = 0; frame < NUM_FRAMES; ++frame)
+	{
+		Sent s;
+		NextRandom ();
+		s.sender = static_cast<uint32_t> (NextRandom () * NUM_NODES);
+		s.size = 100 + frame;
+		s.dest = -1;
+		if (NextRandom () < 0.3)
+		{
+			s.dest = static_cast<int32_t> (NextRandom () * NUM_NODES);
+		}
+		sent.push_back (s);
+	}
+
+	Simulator::Stop (Seconds (25.0));
+	Simulator::Run ();
+	Simulator::Destroy ();
+
+	// expected receivers, ignoring the arrival times which depend on
+	// the order the neighbors are sent to
+	std::vector<Reception> expected;
+	for (std::vector<Sent>::const_iterator s = sent.begin (); s != sent.end (); ++s)
+	{
+		for (std::set<uint32_t>::const_iterator nbr = neighbors[s->sender].begin (); nbr != neighbors[s->sender].end (); ++nbr)
+		{
+			if ((s->dest >= 0) && (static_cast<uint32_t> (s->dest) != *nbr))
+			{
+				continue;
+			}
+			double dx = positions[s->sender].x - positions[*nbr].x;
+			double dy = positions[s->sender].y - positions[*nbr].y;
+			double dz = positions[s->sender].z - positions[*nbr].z;
+			if ((std::sqrt (dx * dx + dy * dy + dz * dz) > ranges[s->sender]) || (s->size % 9 == 0))
+			{
+				continue;
+			}
+			Reception r;
+			r.time = 0;
+			r.receiver = *nbr;
+			r.sender = s->sender;
+			r.size = s->size;
+			expected.push_back (r);
+		}
+	}
+	for (std::vector<Reception>::iterator r = receptions.begin (); r != receptions.end (); ++r)
+	{
+		r->time = 0;
+	}
+	std::sort (expected.begin (), expected.end ());
+	std::sort (receptions.begin (), receptions.end ());
+	return Compare ("Directional", name, expected, receptions);
+}
+
+static Variant
+MakeVariant (const char *name, SpatialIndexType spatialIndex)
+{
+	Variant v;
+	v.name = name;
+	v.spatialIndex = spatialIndex;
+	v.staticTopology = false;
+	v.directUnicast = false;
+	v.batchedDelivery = false;
+	v.earlyReceiveDrop = false;
+	v.receiverThreads = 0;
+	v.macAddressTag = false;
+	v.octreeSlack = 50.0;
+	v.storage = STOCHASTIC_STORAGE_DENSE;
+	return v;
+}
+
+// ******************************************************************
+// MAIN
+// ******************************************************************
+
+int
+main (int argc, char *argv[])
+{
+	CommandLine cmd;
+	cmd.Parse (argc,argv);
+
+	// ***********************************************************************
+	// Index and delivery options. With per link error streams the draws do
+	// not depend on the order the receivers are checked in.
+	// ***********************************************************************
+	std::vector<Variant> indexVariants;
+	indexVariants.push_back (MakeVariant ("None", SPATIAL_INDEX_NONE));
+	indexVariants.push_back (MakeVariant ("Grid", SPATIAL_INDEX_GRID));
+	indexVariants.push_back (MakeVariant ("Verlet", SPATIAL_INDEX_VERLET));
+	indexVariants.push_back (MakeVariant ("Octree", SPATIAL_INDEX_OCTREE));
+	Variant v = MakeVariant ("Octree small slack", SPATIAL_INDEX_OCTREE);
+	v.octreeSlack = 1.0;
+	indexVariants.push_back (v);
+	v = MakeVariant ("StaticTopology", SPATIAL_INDEX_NONE);
+	v.staticTopology = true;
+	indexVariants.push_back (v);
+	v = MakeVariant ("StaticTopology Grid", SPATIAL_INDEX_GRID);
+	v.staticTopology = true;
+	indexVariants.push_back (v);
+	v = MakeVariant ("BatchedDelivery", SPATIAL_INDEX_NONE);
+	v.batchedDelivery = true;
+	indexVariants.push_back (v);
+	v = MakeVariant ("EarlyReceiveDrop", SPATIAL_INDEX_NONE);
+	v.earlyReceiveDrop = true;
+	indexVariants.push_back (v);
+	v = MakeVariant ("BatchedDelivery EarlyReceiveDrop Octree", SPATIAL_INDEX_OCTREE);
+	v.batchedDelivery = true;
+	v.earlyReceiveDrop = true;
+	indexVariants.push_back (v);
+	v = MakeVariant ("ReceiverThreads", SPATIAL_INDEX_NONE);
+	v.receiverThreads = 2;
+	indexVariants.push_back (v);
+	v = MakeVariant ("MacAddressTagEnabled", SPATIAL_INDEX_NONE);
+	v.macAddressTag = true;
+	indexVariants.push_back (v);
+
+	// Direct unicast still makes the shared stream and stochastic draws of
+	// the devices that would drop the frame. With PerLinkErrorStreams the
+	// skipped links do not use a value, so it is not checked with those.
+	std::vector<Variant> unicastVariants;
+	unicastVariants.push_back (MakeVariant ("None", SPATIAL_INDEX_NONE));
+	v = MakeVariant ("DirectUnicast", SPATIAL_INDEX_NONE);
+	v.directUnicast = true;
+	unicastVariants.push_back (v);
+	v = MakeVariant ("DirectUnicast Grid", SPATIAL_INDEX_GRID);
+	v.directUnicast = true;
+	unicastVariants.push_back (v);
+	v = MakeVariant ("DirectUnicast StaticTopology", SPATIAL_INDEX_NONE);
+	v.directUnicast = true;
+	v.staticTopology = true;
+	unicastVariants.push_back (v);
+
+	// The shared stream gives the same draws when the receivers are
+	// visited in the same order, which the indexes keep
+	std::vector<Variant> sharedVariants;
+	sharedVariants.push_back (MakeVariant ("None", SPATIAL_INDEX_NONE));
+	sharedVariants.push_back (MakeVariant ("Grid", SPATIAL_INDEX_GRID));
+	sharedVariants.push_back (MakeVariant ("Verlet", SPATIAL_INDEX_VERLET));
+	sharedVariants.push_back (MakeVariant ("Octree", SPATIAL_INDEX_OCTREE));
+	v = MakeVariant ("BatchedDelivery", SPATIAL_INDEX_NONE);
+	v.batchedDelivery = true;
+	sharedVariants.push_back (v);
+
+	// Stochastic link storage
+	std::vector<Variant> stochasticVariants;
+	stochasticVariants.push_back (MakeVariant ("Dense", SPATIAL_INDEX_NONE));
+	v = MakeVariant ("Hashed", SPATIAL_INDEX_NONE);
+	v.storage = STOCHASTIC_STORAGE_HASHED;
+	stochasticVariants.push_back (v);
+
+	std::vector<Group> groups;
+	Group g;
+	g.name = "Static";
+	g.mobile = false;
+	g.contention = false;
+	g.errorModel = CONSTANT;
+	g.errorRate = 0.2;
+	g.perLinkErrorStreams = true;
+	g.variants = indexVariants;
+	groups.push_back (g);
+
+	g.name = "Mobile";
+	g.mobile = true;
+	groups.push_back (g);
+
+	g.name = "Mobile contention";
+	g.contention = true;
+	groups.push_back (g);
+
+	g.name = "Unicast";
+	g.mobile = true;
+	g.contention = false;
+	g.errorRate = 0.2;
+	g.perLinkErrorStreams = false;
+	g.variants = unicastVariants;
+	groups.push_back (g);
+
+	g.name = "Shared stream";
+	g.variants = sharedVariants;
+	groups.push_back (g);
+
+	g.name = "Stochastic";
+	g.mobile = false;
+	g.errorModel = STOCHASTIC;
+	g.errorRate = 0.0;
+	g.variants = stochasticVariants;
+	groups.push_back (g);
+
+	g.name = "Unicast stochastic";
+	g.variants = unicastVariants;
+	groups.push_back (g);
+
+	// ***********************************************************************
+	// and finally ... off we go!
+	// ***********************************************************************
+	bool ok = true;
+	for (std::vector<Group>::const_iterator group = groups.begin (); group != groups.end (); ++group)
+	{
+		std::vector<Reception> expected = RunVariant (*group, group->variants.front ());
+		std::cout << group->name << " / " << group->variants.front ().name << ": "
+		          << expected.size () << " receptions" << std::endl;
+		for (uint32_t i = 1; i < group->variants.size (); ++i)
+		{
+			ok &= Compare (group->name, group->variants[i].name, expected, RunVariant (*group, group->variants[i]));
+		}
+	}
+
+	ok &= RunDirectional (SPATIAL_INDEX_NONE, "None");
+	ok &= RunDirectional (SPATIAL_INDEX_GRID, "Grid");
+
+	std::cout << (ok ? "All runs match" : "Some runs do not match") << std::endl;
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,203 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (C) 2015 Massachusetts Institute of Technology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "ns3/log.h"
+#include "ns3/assert.h"
+#include "channel-thread-pool.h"
+
+NS_LOG_COMPONENT_DEFINE ("ChannelThreadPool");
+
+namespace ns3 {
+
+#ifdef HAVE_PTHREAD_H
+
+// SystemCondition::Wait clears the condition before it waits, so a
+// signal sent between a worker checking the state and starting to wait
+// is lost. The waits time out after this long so the state is checked
+// again.
+static const uint64_t WAIT_TIMEOUT_NS = 1000000;
+
+ChannelThreadPool::ChannelThreadPool (uint32_t nThreads)
+  : m_nextIndex (0),
+    m_generation (0),
+    m_pending (0),
+    m_stop (false),
+    m_job (0),
+    m_count (0),
+    m_nThreads (nThreads)
+{
+  NS_LOG_FUNCTION (this << nThreads);
+  for (uint32_t i = 0; i < nThreads; ++i)
+    {
+      m_startConditions.push_back (new SystemCondition ());
+    }
+  for (uint32_t i = 0; i < nThreads; ++i)
+    {
+      Ptr<SystemThread> thread = Create<SystemThread> (MakeCallback (&ChannelThreadPool::Worker, this));
+      m_threads.push_back (thread);
+      thread->Start ();
+    }
+}
+
+ChannelThreadPool::~ChannelThreadPool ()
+{
+  NS_LOG_FUNCTION (this);
+  m_mutex.Lock ();
+  m_stop = true;
+  m_mutex.Unlock ();
+  for (uint32_t i = 0; i < m_startConditions.size (); ++i)
+    {
+      m_startConditions[i]->SetCondition (true);
+      m_startConditions[i]->Signal ();
+    }
+
+  for (uint32_t i = 0; i < m_threads.size (); ++i)
+    {
+      m_threads[i]->Join ();
+    }
+  m_threads.clear ();
+
+  for (uint32_t i = 0; i < m_startConditions.size (); ++i)
+    {
+      delete m_startConditions[i];
+    }
+  m_startConditions.clear ();
+}
+
+void
+ChannelThreadPool::Run (Callback<void, uint32_t, uint32_t> job, uint32_t count)
+{
+  if ((m_nThreads == 0) || (count < 2))
+    {
+      job (0, count);
+      return;
+    }
+
+  m_mutex.Lock ();
+  m_job = &job;
+  m_count = count;
+  m_pending = m_nThreads;
+  m_generation++;
+  m_mutex.Unlock ();
+  for (uint32_t i = 0; i < m_startConditions.size (); ++i)
+    {
+      m_startConditions[i]->SetCondition (true);
+      m_startConditions[i]->Signal ();
+    }
+
+  // The calling thread does the first chunk
+  RunChunk (0);
+
+  while (true)
+    {
+      m_mutex.Lock ();
+      bool done = (m_pending == 0);
+      m_mutex.Unlock ();
+      if (done)
+        {
+          break;
+        }
+      m_doneCondition.TimedWait (WAIT_TIMEOUT_NS);
+    }
+
+  m_mutex.Lock ();
+  m_job = 0;
+  m_mutex.Unlock ();
+}
+
+void
+ChannelThreadPool::Worker (void)
+{
+  // A worker that starts late still runs the chunk of a Run that was
+  // already started
+  m_mutex.Lock ();
+  uint32_t index = m_nextIndex++;
+  m_mutex.Unlock ();
+  uint32_t seen = 0;
+
+  SystemCondition *start = m_startConditions[index];
+  while (true)
+    {
+      m_mutex.Lock ();
+      bool stop = m_stop;
+      uint32_t generation = m_generation;
+      m_mutex.Unlock ();
+      if (stop)
+        {
+          return;
+        }
+      if (generation == seen)
+        {
+          start->TimedWait (WAIT_TIMEOUT_NS);
+          continue;
+        }
+      seen = generation;
+
+      RunChunk (index + 1);
+
+      m_mutex.Lock ();
+      bool done = (--m_pending == 0);
+      m_mutex.Unlock ();
+      if (done)
+        {
+          m_doneCondition.SetCondition (true);
+          m_doneCondition.Signal ();
+        }
+    }
+}
+
+// The job and count are only changed while no chunks are running
+void
+ChannelThreadPool::RunChunk (uint32_t chunk)
+{
+  uint64_t chunks = m_nThreads + 1;
+  uint32_t begin = static_cast<uint32_t> (m_count * chunk / chunks);
+  uint32_t end = static_cast<uint32_t> (m_count * (chunk + 1) / chunks);
+  if (begin < end)
+    {
+      (*m_job) (begin, end);
+    }
+}
+
+#else /* HAVE_PTHREAD_H */
+
+ChannelThreadPool::ChannelThreadPool (uint32_t nThreads)
+  : m_nThreads (0)
+{
+  NS_LOG_WARN ("No thread support. Channel work is done on the simulator thread");
+}
+
+ChannelThreadPool::~ChannelThreadPool ()
+{
+}
+
+void
+ChannelThreadPool::Run (Callback<void, uint32_t, uint32_t> job, uint32_t count)
+{
+  job (0, count);
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+uint32_t
+ChannelThreadPool::GetNThreads (void) const
+{
+  return m_nThreads;
+}
+
+} // namespace ns3
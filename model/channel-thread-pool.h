@@ -0,0 +1,93 @@
+/* -*- Mode:C++; c-file-style:"gnu"; indent-tabs-mode:nil; -*- */
+/*
+ * Copyright (C) 2015 Massachusetts Institute of Technology
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef CHANNEL_THREAD_POOL_H
+#define CHANNEL_THREAD_POOL_H
+
+#include <stdint.h>
+#include <vector>
+#include "ns3/core-config.h"
+#include "ns3/callback.h"
+#include "ns3/simple-ref-count.h"
+#include "ns3/ptr.h"
+
+#ifdef HAVE_PTHREAD_H
+#include "ns3/system-thread.h"
+#include "ns3/system-mutex.h"
+#include "ns3/system-condition.h"
+#endif
+
+namespace ns3 {
+
+/**
+ * \ingroup channel
+ *
+ * \brief A fixed set of worker threads that split a range of work
+ * items with the calling thread.
+ *
+ * Run splits the items [0, count) into one contiguous chunk per thread,
+ * including the calling thread, and returns when all chunks are done.
+ * The job must only write to the items of its own chunk. The workers
+ * are ns-3 SystemThreads. Without thread support in ns-3 all the items
+ * are done on the calling thread.
+ */
+class ChannelThreadPool : public SimpleRefCount<ChannelThreadPool>
+{
+public:
+  /**
+   * \param nThreads number of worker threads to start in addition to
+   * the calling thread
+   */
+  ChannelThreadPool (uint32_t nThreads);
+  ~ChannelThreadPool ();
+
+  /**
+   * \returns the number of worker threads
+   */
+  uint32_t GetNThreads (void) const;
+
+  /**
+   * Call job (begin, end) for each chunk of the items [0, count)
+   * and wait for all of them to finish.
+   */
+  void Run (Callback<void, uint32_t, uint32_t> job, uint32_t count);
+
+private:
+#ifdef HAVE_PTHREAD_H
+  void Worker (void);
+  void RunChunk (uint32_t chunk);
+
+  std::vector<Ptr<SystemThread> > m_threads;
+  // One start condition per worker so a worker that waits again does
+  // not clear the condition of a worker that has not woken up yet
+  std::vector<SystemCondition *> m_startConditions;
+  SystemCondition m_doneCondition;
+  SystemMutex m_mutex;       // protects the members below
+  uint32_t m_nextIndex;      // index of the next worker to start
+  uint32_t m_generation;     // incremented for each Run
+  uint32_t m_pending;        // worker chunks not done yet
+  bool     m_stop;
+  const Callback<void, uint32_t, uint32_t> *m_job;
+  uint32_t m_count;
+#endif
+  uint32_t m_nThreads;
+};
+
+} // namespace ns3
+
+#endif /* CHANNEL_THREAD_POOL_H */
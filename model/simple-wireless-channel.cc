@@ -25,16 +25,66 @@
 #include "ns3/uinteger.h"
 #include "ns3/ptr.h"
 #include "ns3/mobility-model.h"
+#include "ns3/rng-seed-manager.h"
+#include "ns3/ethernet-header.h"
+#ifdef NS3_MPI
+#include "ns3/mpi-interface.h"
+#endif
 #include "simple-wireless-channel.h"
 #include "simple-wireless-net-device.h"
 #include <iomanip>
+#include <algorithm>
+#include <cmath>
 
 NS_LOG_COMPONENT_DEFINE ("SimpleWirelessChannel");
 
 namespace ns3 {
 
+// Special values returned by GetPacketErrorRate. No random value is
+// drawn for packets with these error rates.
+static const double NEVER_IN_ERROR = -1.0;
+static const double ALWAYS_IN_ERROR = -2.0;
+
+// Largest number of entries in the PER curve lookup table
+static const double MAX_PER_TABLE_SIZE = 1000000;
+
 NS_OBJECT_ENSURE_REGISTERED (SimpleWirelessChannel);
 
+//********************************************************************
+// Error model policies
+
+bool ConstantErrorPolicy::LinkDown (SimpleWirelessChannel &channel, uint32_t srcId, uint32_t dstId)
+{
+  return false;
+}
+
+bool ConstantErrorPolicy::InError (SimpleWirelessChannel &channel, double distance, uint32_t srcId, uint32_t dstId)
+{
+  return channel.DrawPacketError (channel.m_errorRate, distance, srcId, dstId);
+}
+
+bool PerCurveErrorPolicy::LinkDown (SimpleWirelessChannel &channel, uint32_t srcId, uint32_t dstId)
+{
+  return false;
+}
+
+bool PerCurveErrorPolicy::InError (SimpleWirelessChannel &channel, double distance, uint32_t srcId, uint32_t dstId)
+{
+  return channel.DrawPacketError (channel.LookupPERCurve (distance), distance, srcId, dstId);
+}
+
+bool StochasticErrorPolicy::LinkDown (SimpleWirelessChannel &channel, uint32_t srcId, uint32_t dstId)
+{
+  return channel.StochasticLinkDown (srcId, dstId);
+}
+
+// no per packet errors with the stochastic model
+bool StochasticErrorPolicy::InError (SimpleWirelessChannel &channel, double distance, uint32_t srcId, uint32_t dstId)
+{
+  return false;
+}
+
+
 TypeId 
 SimpleWirelessChannel::GetTypeId (void)
 {
@@ -78,18 +128,178 @@ SimpleWirelessChannel::GetTypeId (void)
                    TimeValue (MicroSeconds (100.0)),
                    MakeTimeAccessor (&SimpleWirelessChannel::m_downDuration),
                    MakeTimeChecker ())
+    .AddAttribute ("StochasticLinkStorage", 
+                   "How the state of the links is stored for Stochastic Error Model",
+                   EnumValue (STOCHASTIC_STORAGE_DENSE),
+                   MakeEnumAccessor (&SimpleWirelessChannel::m_stochasticStorage),
+                   MakeEnumChecker (STOCHASTIC_STORAGE_DENSE, "Dense",
+                                    STOCHASTIC_STORAGE_HASHED, "Hashed"))
+    .AddAttribute ("ContentionUpdateInterval", 
+                   "How often the channel recomputes the fixed contention neighbor counts of moving devices. Zero counts the neighbors on every send",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&SimpleWirelessChannel::m_contentionInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("PositionRefreshInterval", 
+                   "How often the channel reads the positions of moving devices. Sends within the interval use the positions from the last read. Zero reads them on every send",
+                   TimeValue (Seconds (0)),
+                   MakeTimeAccessor (&SimpleWirelessChannel::m_positionRefreshInterval),
+                   MakeTimeChecker ())
+    .AddAttribute ("PerLinkErrorStreams", 
+                   "Draw the packet error values for each link from its own counter based stream so they do not depend on the order links are checked in",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessChannel::m_perLinkErrorStreams),
+                   MakeBooleanChecker ())
+    .AddAttribute ("LookAheadPacketSize", 
+                   "Size of the smallest packet sent on the channel, used by GetLookAhead. The look ahead is not applied to the simulator by the channel",
+                   UintegerValue (20),
+                   MakeUintegerAccessor (&SimpleWirelessChannel::m_lookAheadPacketSize),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("ReceiverThreads", 
+                   "Number of threads, in addition to the simulator thread, that compute the distances and error rates of the receivers of a packet. Zero does not use threads",
+                   UintegerValue (0),
+                   MakeUintegerAccessor (&SimpleWirelessChannel::m_receiverThreads),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("ReceiverThreadsMinDevices", 
+                   "Smallest number of devices to check for a packet before the receiver threads are used",
+                   UintegerValue (2048),
+                   MakeUintegerAccessor (&SimpleWirelessChannel::m_parallelMinReceivers),
+                   MakeUintegerChecker<uint32_t> ())
+    .AddAttribute ("StochasticLazyInit", 
+                   "Create the state of each link for Stochastic Error Model the first time it is used",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessChannel::m_stochasticLazy),
+                   MakeBooleanChecker ())
+    .AddAttribute ("StochasticDirectCatchUp", 
+                   "Pick the current state of an idle stochastic link from the on/off transition probabilities instead of stepping through every state it went through",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessChannel::m_stochasticDirectCatchUp),
+                   MakeBooleanChecker ())
+    .AddAttribute ("SpatialIndex", 
+                   "Spatial index used to select the devices checked when sending a packet",
+                   EnumValue (SPATIAL_INDEX_NONE),
+                   MakeEnumAccessor (&SimpleWirelessChannel::m_spatialIndex),
+                   MakeEnumChecker (SPATIAL_INDEX_NONE, "None",
+                                    SPATIAL_INDEX_GRID, "Grid",
+                                    SPATIAL_INDEX_VERLET, "Verlet",
+                                    SPATIAL_INDEX_OCTREE, "Octree"))
+    .AddAttribute ("MaxNodeSpeed", 
+                   "Highest speed (m/s) of any node on the channel. Used by the Verlet spatial index",
+                   DoubleValue (0.0),
+                   MakeDoubleAccessor (&SimpleWirelessChannel::m_maxNodeSpeed),
+                   MakeDoubleChecker<double> (0.0))
+    .AddAttribute ("VerletSkin", 
+                   "Distance (meters) past the range that the neighbor lists of the Verlet spatial index cover",
+                   DoubleValue (50.0),
+                   MakeDoubleAccessor (&SimpleWirelessChannel::m_verletSkin),
+                   MakeDoubleChecker<double> (0.0))
+    .AddAttribute ("OctreeSlack", 
+                   "Distance (meters) devices may move from where the octree was built before it is rebuilt",
+                   DoubleValue (50.0),
+                   MakeDoubleAccessor (&SimpleWirelessChannel::m_octreeSlack),
+                   MakeDoubleChecker<double> (0.0))
+    .AddAttribute ("PerTableResolution",
+                   "Resolution (meters) of the lookup table built from the PER curve",
+                   DoubleValue (1.0),
+                   MakeDoubleAccessor (&SimpleWirelessChannel::m_perResolution),
+                   MakeDoubleChecker<double> (0.0))
+    .AddAttribute ("StaticTopology", 
+                   "Precompute the receivers of each sender. Only for scenarios where nodes do not move.",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessChannel::m_staticTopology),
+                   MakeBooleanChecker ())
+    .AddAttribute ("DirectUnicast", 
+                   "Only deliver unicast frames to the destination and to devices that are promiscuous or have pcap enabled",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessChannel::m_directUnicast),
+                   MakeBooleanChecker ())
+    .AddAttribute ("EarlyReceiveDrop", 
+                   "Check the receive error model of each receiver when the packet is sent. One event fires the traces of all the dropped receptions of a transmission",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessChannel::m_earlyReceiveDrop),
+                   MakeBooleanChecker ())
+    .AddAttribute ("BatchedDelivery", 
+                   "Keep the packet and addresses of a transmission in one record shared by the delivery events, with one event for each receiving node and arrival time",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessChannel::m_batchedDelivery),
+                   MakeBooleanChecker ())
     ;
   return tid;
 }
 
+// The shared stream takes the next automatic stream the way a
+// UniformRandomVariable would
 SimpleWirelessChannel::SimpleWirelessChannel ()
+  : m_random (RngSeedManager::GetSeed (), RngSeedManager::GetNextStreamIndex (), RngSeedManager::GetRun ())
 {
 	// Default to a constant error model with 0 errors
-	m_random = CreateObject<UniformRandomVariable> ();
 	m_ErrorModel = CONSTANT;
 	m_errorRate = 0.0;
 	m_fixedContentionEnabled = false;
 	m_fixedContentionRange = 0;
+	m_stochasticStorage = STOCHASTIC_STORAGE_DENSE;
+	m_stochasticLazy = false;
+	m_stochasticDirectCatchUp = false;
+	m_spatialIndex = SPATIAL_INDEX_NONE;
+	m_indexDirty = true;
+	m_cellSize = 0;
+	m_snapshotDirty = true;
+	m_maxNodeSpeed = 0.0;
+	m_verletSkin = 50.0;
+	m_verletDirty = true;
+	m_octreeDirty = true;
+	m_octreeSlack = 50.0;
+	m_octreeDrift = 0;
+	m_rangesDirty = true;
+	m_largestRange = 0;
+	m_largestRangeDefault = 0;
+	m_txRange = 0;
+	m_staticTopology = false;
+	m_staticDirty = true;
+	m_perResolution = 1.0;
+	m_perTableResolution = 0;
+	m_perBuiltResolution = 0;
+	m_perTableDirty = true;
+	m_directUnicast = false;
+	m_directDirty = true;
+	m_directSend = false;
+	m_batchedDelivery = false;
+	m_earlyReceiveDrop = false;
+	m_contentionDirty = true;
+	m_contentionRange = 0;
+	m_perLinkErrorStreams = false;
+	m_streamBase = -1;
+	m_linkSequences.SetStorage (STOCHASTIC_STORAGE_HASHED);
+	m_linkKeyValid = false;
+	m_distributed = false;
+	m_localSystemId = 0;
+	m_lookAheadPacketSize = 20;
+	m_receiverThreads = 0;
+	m_parallelMinReceivers = 2048;
+	m_threadPoolSize = 0;
+	m_parallelIndexed = false;
+	m_parallelLimitSquared = 0;
+}
+
+void
+SimpleWirelessChannel::DoDispose (void)
+{
+  for (std::map<const MobilityModel *, std::vector<uint32_t> >::iterator it = m_mobilitySlots.begin (); it != m_mobilitySlots.end (); ++it)
+    {
+      m_mobility[it->second.front ()]->TraceDisconnectWithoutContext ("CourseChange", MakeCallback (&SimpleWirelessChannel::CourseChanged, this));
+    }
+  m_mobilitySlots.clear ();
+  m_mobility.clear ();
+  m_grid.clear ();
+  m_verletLists.clear ();
+  m_octree.clear ();
+  m_nodeSlots.clear ();
+  m_staticReceivers.clear ();
+  m_addressSlots.clear ();
+  m_threadPool = 0;
+  m_threadPoolSize = 0;
+  m_deviceSlots.clear ();
+  m_devices.clear ();
+  Channel::DoDispose ();
 }
 
 void
@@ -99,9 +309,14 @@ SimpleWirelessChannel::Send (Ptr<Packet> p, uint16_t protocol,
 {
   NS_LOG_FUNCTION (p << protocol << to << from << sender);
   
-  uint32_t senderNodeId = sender->GetNode()->GetId();
+  // All receivers share one copy of the packet. The device makes its own
+  // copy if it has to change it.
+  Ptr<const Packet> shared = p->Copy ();
   
-  if (m_fixedContentionEnabled)
+  // With a contention update interval the channel keeps the neighbor
+  // counts itself and nothing is counted here
+  bool countContention = m_fixedContentionEnabled && m_contentionInterval.IsZero ();
+  if (countContention)
   {
      sender->ClearNbrCount();
      
@@ -114,58 +329,222 @@ SimpleWirelessChannel::Send (Ptr<Packet> p, uint16_t protocol,
          m_fixedContentionRange = m_range;
   }
 
-  for (std::vector<Ptr<SimpleWirelessNetDevice> >::const_iterator i = m_devices.begin (); i != m_devices.end (); ++i)
+  UpdatePositionSnapshot ();
+  
+  // With a position refresh interval the sender is placed where the
+  // snapshot has it so all distances come from the same snapshot
+  Vector senderPosition;
+  if (m_positionRefreshInterval.IsZero ())
+  {
+     Ptr<MobilityModel> senderMobility = sender->GetNode ()->GetObject<MobilityModel> ();
+     NS_ASSERT_MSG (senderMobility, "Error:  nodes must have mobility models");
+     senderPosition = senderMobility->GetPosition ();
+  }
+  else
+  {
+     std::map<const SimpleWirelessNetDevice *, uint32_t>::const_iterator it = m_deviceSlots.find (PeekPointer (sender));
+     NS_ASSERT_MSG (it != m_deviceSlots.end (), "Sender is not on this channel");
+     senderPosition = Vector (m_posX[it->second], m_posY[it->second], m_posZ[it->second]);
+  }
+  
+  // Nodes of other ranks are sent for by their own rank
+  if (m_distributed && (sender->GetNode ()->GetSystemId () != m_localSystemId))
     {
-      Ptr<SimpleWirelessNetDevice> tmp = *i;
-      uint32_t destNodeId = tmp->GetNode()->GetId();
-      
+      NS_LOG_INFO ("Node " << sender->GetNode ()->GetId () << " NOT sending. Node belongs to system " << sender->GetNode ()->GetSystemId ());
+      return;
+    }
+  
+  m_directSend = m_directUnicast && PrepareDirectUnicast (to);
+  
+  // A directional frame only goes to the devices of the destination node
+  // and only those devices are counted as contention neighbors, so only
+  // they have to be checked.
+  bool directional = (destId != NO_DIRECTIONAL_NBR);
+  
+  if (!directional && m_staticTopology && PrepareStaticTopology ())
+    {
+      SendStatic (shared, protocol, to, from, sender, txTime, destId);
+      FlushDeliveries (shared, protocol, to, from);
+      return;
+    }
+
+  // Anything farther than this is out of both the transmission range and the
+  // contention range. The margin covers rounding so that the exact distance
+  // test is still the one that decides for devices near the edge of the range.
+  m_txRange = GetTxRange (sender);
+  double limit = m_txRange;
+  if (countContention && (m_fixedContentionRange > limit))
+    {
+      limit = m_fixedContentionRange;
+    }
+  double limitSquared = limit * limit * (1.0 + 1e-9);
+  
+  // Pick the devices to check. With the spatial index these are only the
+  // devices near the sender. The candidates are sorted so the devices are
+  // visited in the same order as the full scan. Without fixed contention
+  // a direct unicast only has to check the devices that would keep it,
+  // unless the other devices still take values from a shared stream.
+  bool indexed = false;
+  uint32_t count;
+  if (directional)
+    {
+      indexed = true;
+      GetNodeDevices (destId, m_candidates);
+      count = m_candidates.size ();
+    }
+  else if (m_directSend && !countContention && m_perLinkErrorStreams && (m_ErrorModel != STOCHASTIC))
+    {
+      indexed = true;
+      GetDirectReceivers (to, m_candidates);
+      count = m_candidates.size ();
+    }
+  else if ((m_spatialIndex == SPATIAL_INDEX_GRID) && PrepareSpatialIndex ())
+    {
+      indexed = true;
+      GetCandidateDevices (senderPosition, m_candidates);
+      count = m_candidates.size ();
+    }
+  else if ((m_spatialIndex == SPATIAL_INDEX_VERLET) && PrepareVerletLists ())
+    {
+      indexed = true;
+      GetVerletCandidates (sender, limit, m_candidates);
+      count = m_candidates.size ();
+    }
+  else if ((m_spatialIndex == SPATIAL_INDEX_OCTREE) && PrepareOctree ())
+    {
+      indexed = true;
+      GetOctreeCandidates (senderPosition, limit + m_octreeDrift, m_candidates);
+      count = m_candidates.size ();
+    }
+  else
+    {
+      count = m_devices.size ();
+    }
+  
+  // For large numbers of devices the distances and error rates are computed
+  // by the receiver threads. Everything that draws random values is still
+  // done in order below so the results are the same as with one thread.
+  const double *errorRates = 0;
+  if ( (m_receiverThreads > 0) && (count > 0) && (count >= m_parallelMinReceivers) )
+    {
+      EvaluateReceiversParallel (senderPosition, indexed, count, limitSquared);
+      errorRates = &m_errorRates[0];
+    }
+  else if (indexed)
+    {
+      ComputeDistancesSquared (senderPosition, m_candidates);
+    }
+  else
+    {
+      ComputeDistancesSquared (senderPosition);
+    }
+  
+  switch (m_ErrorModel)
+    {
+    case CONSTANT:
+      SendWithPolicy<ConstantErrorPolicy> (shared, protocol, to, from, sender, txTime, destId, indexed, count, limitSquared, countContention, errorRates);
+      break;
+    case PER_CURVE:
+      SendWithPolicy<PerCurveErrorPolicy> (shared, protocol, to, from, sender, txTime, destId, indexed, count, limitSquared, countContention, errorRates);
+      break;
+    case STOCHASTIC:
+      SendWithPolicy<StochasticErrorPolicy> (shared, protocol, to, from, sender, txTime, destId, indexed, count, limitSquared, countContention, errorRates);
+      break;
+    }
+  FlushDeliveries (shared, protocol, to, from);
+}
+
+// Check every candidate device and schedule the reception on the ones
+// that get the packet. The error model and the features that are on are
+// template parameters so the loop only has the checks it needs. If the
+// error rates were computed by the receiver threads they are passed in.
+template <class ErrorPolicy, bool Contention, bool Directional>
+void
+SimpleWirelessChannel::SendToDevices (Ptr<const Packet> p, uint16_t protocol,
+                                      Mac48Address to, Mac48Address from,
+                                      Ptr<SimpleWirelessNetDevice> sender, Time txTime, uint32_t destId,
+                                      bool indexed, uint32_t count, double limitSquared,
+                                      const double *errorRates)
+{
+  uint32_t senderNodeId = sender->GetNode()->GetId();
+  for (uint32_t k = 0; k < count; ++k)
+    {
+      uint32_t slot = indexed ? m_candidates[k] : k;
+      double distanceSquared = m_distSq[k];
+      Ptr<SimpleWirelessNetDevice> tmp = m_devices[slot];
+      uint32_t destNodeId = m_nodeIds[slot];
+
       // don't send to ourselves
       if (tmp == sender)
         {
           NS_LOG_INFO ("Node " << senderNodeId << " NOT sending to node " << destNodeId << ". Node is self");
           continue;
         }
-        
+
       // See if we have directional networking enabled and if so if this is destination node
-      if ( (destId != NO_DIRECTIONAL_NBR) && (destNodeId != destId) )
+      if ( Directional && (destNodeId != destId) )
       {
          NS_LOG_INFO ("Node " << senderNodeId << " NOT sending to node " << destNodeId << ". Directional networking enabled and node is not destination " << destId);
          continue;
       }
-      
+
       // See if we are using stochastic. If so see if the sender's link
       // to the destination is up or down
-      if (CheckStochasticError (senderNodeId, destNodeId))
+      if (ErrorPolicy::LinkDown (*this, senderNodeId, destNodeId))
       {
          NS_LOG_INFO ("Node " << senderNodeId << " NOT sending to node " << destNodeId << ". Stochastic error enabled and link to node is in OFF state");
          continue;
       }
 
-      Ptr<MobilityModel> a = sender->GetNode ()->GetObject<MobilityModel> ();
-      Ptr<MobilityModel> b = tmp->GetNode ()->GetObject<MobilityModel> ();
-      NS_ASSERT_MSG (a && b, "Error:  nodes must have mobility models");
-      
+      // Quick check on the squared distance before taking the square root
+      if (distanceSquared > limitSquared)
+      {
+         NS_LOG_INFO ("Node " << senderNodeId << " NOT sending to node " << destNodeId << ". distance of " << std::sqrt (distanceSquared) << "  is out of range");
+         continue;
+      }
+
       // Get distance and determine error rate based on that
       // and the error model
-      double distance = a->GetDistanceFrom (b);
-      
-      
+      double distance = std::sqrt (distanceSquared);
+
+
       // if fixed contention is enabled then we need to peg the neighbor count
-      if ( (m_fixedContentionEnabled) && (distance < m_fixedContentionRange) )
+      if ( Contention && (distance < m_fixedContentionRange) )
       {
          sender->IncrementNbrCount();
          NS_LOG_INFO ("Node " << senderNodeId << " pegging nbr count for contention. distane is " << distance << ". count is now " << sender->GetNbrCount());
       }
-      
+
       // Is this packet beyond the transmission range?
-      if (distance > m_range)
+      if (distance > m_txRange)
       {
          NS_LOG_INFO ("Node " << senderNodeId << " NOT sending to node " << destNodeId << ". distance of " << distance << "  is out of range");
          continue;
       }
-      
+
+      // The device would only throw the frame away. The value of the
+      // shared stream is still drawn so the other links get the same
+      // values as without direct unicast.
+      if (m_directSend && !IsDirectReceiver (slot, to))
+      {
+         if (!m_perLinkErrorStreams)
+         {
+            if (errorRates)
+            {
+               DrawPacketError (errorRates[k], distance, senderNodeId, destNodeId);
+            }
+            else
+            {
+               ErrorPolicy::InError (*this, distance, senderNodeId, destNodeId);
+            }
+         }
+         NS_LOG_INFO ("Node " << senderNodeId << " NOT sending to node " << destNodeId << ". Unicast frame is for another host");
+         continue;
+      }
+
       // Is this packet in error or can we send it based on the distance?
-      if (packetInError(distance))
+      if (errorRates ? DrawPacketError (errorRates[k], distance, senderNodeId, destNodeId) :
+                       ErrorPolicy::InError (*this, distance, senderNodeId, destNodeId))
       {
          continue;
       }
@@ -175,117 +554,1431 @@ SimpleWirelessChannel::Send (Ptr<Packet> p, uint16_t protocol,
       NS_LOG_INFO ("Node " << senderNodeId << " sending to node " << destNodeId 
         << " at distance " << distance << " meters; time (ns): "<< Simulator::Now().GetNanoSeconds ()
         << " txDelay: " << txTime << "  propDelay: " << propDelay);
-        
-      Simulator::ScheduleWithContext (destNodeId, NanoSeconds (txTime + propDelay),
-                                      &SimpleWirelessNetDevice::Receive, tmp, p->Copy (), protocol, to, from);
 
+      ScheduleReceive (p, protocol, to, from, slot, NanoSeconds (txTime + propDelay));
     }
 }
 
-void 
-SimpleWirelessChannel::Add (Ptr<SimpleWirelessNetDevice> device)
+// Pick the send loop for the contention and directional settings
+template <class ErrorPolicy>
+void
+SimpleWirelessChannel::SendWithPolicy (Ptr<const Packet> p, uint16_t protocol,
+                                       Mac48Address to, Mac48Address from,
+                                       Ptr<SimpleWirelessNetDevice> sender, Time txTime, uint32_t destId,
+                                       bool indexed, uint32_t count, double limitSquared, bool contention,
+                                       const double *errorRates)
 {
-  m_devices.push_back (device);
+  bool directional = (destId != NO_DIRECTIONAL_NBR);
+  if (contention && directional)
+    {
+      SendToDevices<ErrorPolicy, true, true> (p, protocol, to, from, sender, txTime, destId, indexed, count, limitSquared, errorRates);
+    }
+  else if (contention)
+    {
+      SendToDevices<ErrorPolicy, true, false> (p, protocol, to, from, sender, txTime, destId, indexed, count, limitSquared, errorRates);
+    }
+  else if (directional)
+    {
+      SendToDevices<ErrorPolicy, false, true> (p, protocol, to, from, sender, txTime, destId, indexed, count, limitSquared, errorRates);
+    }
+  else
+    {
+      SendToDevices<ErrorPolicy, false, false> (p, protocol, to, from, sender, txTime, destId, indexed, count, limitSquared, errorRates);
+    }
 }
 
-uint32_t 
-SimpleWirelessChannel::GetNDevices (void) const
+// Schedule the reception of the packet on one device. Receivers of
+// batched deliveries and dropped receptions are only recorded and
+// FlushDeliveries schedules their events once the transmission has
+// been checked against every device.
+void
+SimpleWirelessChannel::ScheduleReceive (Ptr<const Packet> p, uint16_t protocol,
+                                        Mac48Address to, Mac48Address from,
+                                        uint32_t slot, Time delay)
 {
-  return m_devices.size ();
+  // Devices on nodes of other ranks get the packet through MPI
+  if (m_systemIds[slot] != m_localSystemId)
+    {
+      SendRemote (p, protocol, to, from, slot, delay);
+      return;
+    }
+  
+  // Drop the packet now if the receiver's error model corrupts it. Only
+  // the traces are fired, from the event FlushDeliveries schedules for
+  // all the drops of the transmission.
+  bool dropped = m_earlyReceiveDrop && m_devices[slot]->IsReceiveCorrupt (p);
+  
+  if (m_batchedDelivery || dropped)
+    {
+      PendingDelivery delivery;
+      delivery.arrival = delay;
+      delivery.slot = slot;
+      delivery.dropped = dropped;
+      m_pending.push_back (delivery);
+      return;
+    }
+  
+  Simulator::ScheduleWithContext (m_nodeIds[slot], delay,
+                                  &SimpleWirelessNetDevice::Receive, m_devices[slot], p, protocol, to, from);
 }
 
-Ptr<NetDevice> 
-SimpleWirelessChannel::GetDevice (uint32_t i) const
+// Send the packet to a device on a node of another rank. The MAC
+// fields travel in an Ethernet header which the device removes.
+void
+SimpleWirelessChannel::SendRemote (Ptr<const Packet> p, uint16_t protocol,
+                                   Mac48Address to, Mac48Address from,
+                                   uint32_t slot, Time delay)
 {
-  return m_devices[i];
+#ifdef NS3_MPI
+  Ptr<Packet> remote = p->Copy ();
+  EthernetHeader header (false);
+  header.SetDestination (to);
+  header.SetSource (from);
+  header.SetLengthType (protocol);
+  remote->AddHeader (header);
+  
+  NS_LOG_INFO ("Sending to node " << m_nodeIds[slot] << " on system " << m_systemIds[slot]);
+  MpiInterface::SendPacket (remote, Simulator::Now () + delay, m_nodeIds[slot], m_devices[slot]->GetIfIndex ());
+#else
+  NS_FATAL_ERROR ("Device on another system but MPI is not enabled");
+#endif
 }
 
-
-//********************************************************************
-// contention functions
-void SimpleWirelessChannel::EnableFixedContention(void)
+Time
+SimpleWirelessChannel::GetLookAhead (void)
 {
-  m_fixedContentionEnabled = true;
+  UpdatePositionSnapshot ();
   
-  // Set up all the devices to support contention.
-  // IMPORTANT NOTE: There may not be any devices at this point on the channel.
-  // If there are not any, then the first packet sent by the device will use the
-  // full data rate and will not use contention. That is, the device will be notified
-  // by the channel when the channel gets the first packet from the device and that is
-  // after the data rate has been used to set the tx time. All subsequent packets sent
-  // by the device will use contention just not the first one.
-  for (std::vector<Ptr<SimpleWirelessNetDevice> >::const_iterator i = m_devices.begin (); i != m_devices.end (); ++i)
-  {
-    Ptr<SimpleWirelessNetDevice> tmp = *i;
-    tmp->ClearNbrCount();
-  }
-}
+  // Shortest time to send a packet on any device. Contention only
+  // makes this longer.
+  double minTxTime = 0;
+  for (uint32_t slot = 0; slot < m_devices.size (); ++slot)
+    {
+      double txTime = m_devices[slot]->GetDataRate ().CalculateTxTime (m_lookAheadPacketSize);
+      if ((slot == 0) || (txTime < minTxTime))
+        {
+          minTxTime = txTime;
+        }
+    }
   
-void SimpleWirelessChannel::SetFixedContentionRange(double range)
+  // Only the tx time is certain. Nodes may move up to any node of
+  // another system so the propagation delay can be zero.
+  bool remotePairs = false;
+  for (uint32_t slot = 1; slot < m_devices.size (); ++slot)
+    {
+      if (m_systemIds[slot] != m_systemIds[0])
+        {
+          remotePairs = true;
+          break;
+        }
+    }
+  
+  if (!remotePairs)
+    {
+      return Time::Max ();
+    }
+  
+  Time lookAhead = Seconds (minTxTime);
+  NS_LOG_DEBUG ("Look ahead " << lookAhead << " min tx time " << minTxTime);
+  return lookAhead;
+}
+
+uint32_t
+SimpleWirelessChannel::GetGeographicSystemId (const Vector &position, double minX, double maxX, uint32_t nSystems)
 {
-  m_fixedContentionRange = range;
+  NS_ASSERT (nSystems > 0);
+  if ((maxX <= minX) || (position.x <= minX))
+    {
+      return 0;
+    }
+  uint32_t systemId = static_cast<uint32_t> ((position.x - minX) / (maxX - minX) * nSystems);
+  return std::min (systemId, nSystems - 1);
 }
 
-//********************************************************************
-// Error Model functions
-void SimpleWirelessChannel::setErrorModelType(ErrorModelType type) 
+void
+SimpleWirelessChannel::FlushDeliveries (Ptr<const Packet> p, uint16_t protocol,
+                                        Mac48Address to, Mac48Address from)
 {
-  m_ErrorModel = type;
+  if (m_pending.empty ())
+    {
+      return;
+    }
   
-  // reset range to 0 if error model is PER CURVE so that
-  // we can compare to distances added to the curve to
-  // get the max range
-  if (m_ErrorModel == PER_CURVE)
-  {
-     m_range = 0;
-  }
+  // Receivers with the same arrival time keep the order they were
+  // checked in, as the separate events would.
+  Ptr<DeliveryBatch> batch = Create<DeliveryBatch> ();
+  batch->packet = p;
+  batch->protocol = protocol;
+  batch->to = to;
+  batch->from = from;
+  batch->next = 0;
+  batch->receivers.swap (m_pending);
+  std::stable_sort (batch->receivers.begin (), batch->receivers.end ());
+  
+  const PendingDelivery &first = batch->receivers.front ();
+  if (!m_batchedDelivery)
+    {
+      // Only dropped receptions were recorded. One event fires all their
+      // traces at the first arrival time.
+      Simulator::ScheduleWithContext (m_nodeIds[first.slot], first.arrival, &SimpleWirelessChannel::DeliverDrops, this, batch);
+      return;
+    }
+  
+  // One event for each receiving node and arrival time. The events are
+  // all scheduled now, in order of arrival, so they run in the same
+  // order as one event per receiver would.
+  for (uint32_t i = 0; i < batch->receivers.size (); ++i)
+    {
+      const PendingDelivery &delivery = batch->receivers[i];
+      if ((i > 0) && (delivery.arrival == batch->receivers[i - 1].arrival) &&
+          (m_nodeIds[delivery.slot] == m_nodeIds[batch->receivers[i - 1].slot]))
+        {
+          continue;
+        }
+      Simulator::ScheduleWithContext (m_nodeIds[delivery.slot], delivery.arrival, &SimpleWirelessChannel::DeliverBatch, this, batch);
+    }
 }
 
-void SimpleWirelessChannel::setErrorRate(double error) 
+// Fire the traces of all the receptions of one transmission that were
+// dropped early. The event runs at the first arrival time in the context
+// of the first receiver, so the other receivers see their traces up to
+// the difference in propagation delay early.
+void
+SimpleWirelessChannel::DeliverDrops (Ptr<DeliveryBatch> batch)
 {
-  m_errorRate = error;
+  for (uint32_t i = 0; i < batch->receivers.size (); ++i)
+    {
+      m_devices[batch->receivers[i].slot]->ReceiveDropped (batch->packet, batch->protocol, batch->to, batch->from);
+    }
+  NS_LOG_DEBUG ("Fired traces of " << batch->receivers.size () << " dropped receptions");
 }
 
-void SimpleWirelessChannel::addToPERmodel(double distance, double error)
+// Pass the packet to the next receivers of the batch that are on the
+// same node and have the same arrival time. The event runs in the
+// context of that node.
+void
+SimpleWirelessChannel::DeliverBatch (Ptr<DeliveryBatch> batch)
 {
-  // NOTE: distance is in meters
-  mPERmap.insert(std::pair<double, double>(distance, error));
+  Time arrival = batch->receivers[batch->next].arrival;
+  uint32_t nodeId = m_nodeIds[batch->receivers[batch->next].slot];
+  while ((batch->next < batch->receivers.size ()) &&
+         (batch->receivers[batch->next].arrival == arrival) &&
+         (m_nodeIds[batch->receivers[batch->next].slot] == nodeId))
+    {
+      const PendingDelivery &delivery = batch->receivers[batch->next];
+      ++batch->next;
+      if (delivery.dropped)
+        {
+          m_devices[delivery.slot]->ReceiveDropped (batch->packet, batch->protocol, batch->to, batch->from);
+        }
+      else
+        {
+          m_devices[delivery.slot]->Receive (batch->packet, batch->protocol, batch->to, batch->from);
+        }
+    }
+  NS_LOG_DEBUG ("Delivered batch up to receiver " << batch->next << " of " << batch->receivers.size ());
+}
+
+void 
+SimpleWirelessChannel::Add (Ptr<SimpleWirelessNetDevice> device)
+{
+  m_deviceSlots[PeekPointer (device)] = m_devices.size ();
+  m_devices.push_back (device);
   
-  if (distance > m_range)
-  {
-     m_range = distance;
-  }
+  // The device may not have a node or mobility model yet so the
+  // position snapshot is rebuilt on the next send
+  m_snapshotDirty = true;
+  m_directDirty = true;
+  m_contentionDirty = true;
 }
 
+void
+SimpleWirelessChannel::DeviceChanged (void)
+{
+  m_directDirty = true;
+  m_rangesDirty = true;
+  m_staticDirty = true;
+}
 
-//********************************************************************
-// Stochastic error functions
+bool
+SimpleWirelessChannel::GetEarlyReceiveDrop (void) const
+{
+  return m_earlyReceiveDrop;
+}
 
-void SimpleWirelessChannel::InitStochasticModel()
+uint32_t 
+SimpleWirelessChannel::GetNDevices (void) const
 {
-  // Build the map of neighbor links, setting all links to
-  // ON state and pick a duration for that state.
-  if (m_ErrorModel == STOCHASTIC)
-  {
-     if (m_devices.size() == 0)
-     {
-        NS_LOG_ERROR ("InitStochasticModel called but there are no devices on the channel. Be sure to call InitStochasticModel AFTER devices have been added.");
-     }
-     
-     m_randomUp = CreateObject<ExponentialRandomVariable> ();
-     m_randomDown = CreateObject<ExponentialRandomVariable> ();
+  return m_devices.size ();
+}
 
-     m_randomUp->SetAttribute ("Mean", DoubleValue (m_upDuration.GetMicroSeconds()));
-     m_randomDown->SetAttribute ("Mean", DoubleValue (m_downDuration.GetMicroSeconds()));
-     
-     Time currTime = Simulator::Now();
+Ptr<NetDevice> 
+SimpleWirelessChannel::GetDevice (uint32_t i) const
+{
+  return m_devices[i];
+}
+
+
+//********************************************************************
+// Position snapshot functions
+
+// Bring the positions of all devices up to date for the current time.
+// Devices that are not moving only change position with a course change
+// so only the moving devices are read again when time has advanced.
+void SimpleWirelessChannel::UpdatePositionSnapshot (void)
+{
+  if (m_snapshotDirty)
+  {
+     uint32_t n = m_devices.size ();
+     m_mobility.resize (n);
+     m_posX.resize (n);
+     m_posY.resize (n);
+     m_posZ.resize (n);
+     m_posTime.resize (n);
+     m_nodeIds.resize (n);
+     m_systemIds.resize (n);
+     m_deviceMoving.resize (n);
+     m_movingDevices.clear ();
+     m_fastDevices.clear ();
+     
+     for (uint32_t slot = 0; slot < n; ++slot)
+     {
+        if (m_mobility[slot] == 0)
+        {
+           Ptr<Node> node = m_devices[slot]->GetNode ();
+           Ptr<MobilityModel> mobility = node->GetObject<MobilityModel> ();
+           NS_ASSERT_MSG (mobility, "Error:  nodes must have mobility models");
+           m_mobility[slot] = mobility;
+           m_nodeIds[slot] = node->GetId ();
+           m_systemIds[slot] = node->GetSystemId ();
+           
+           // Track position changes. Only connect once to each mobility
+           // model in case a node has more than one device on this channel.
+           std::vector<uint32_t> &slots = m_mobilitySlots[PeekPointer (mobility)];
+           if (slots.empty ())
+           {
+              mobility->TraceConnectWithoutContext ("CourseChange", MakeCallback (&SimpleWirelessChannel::CourseChanged, this));
+           }
+           slots.push_back (slot);
+        }
+        ReadPosition (slot);
+     }
+     
+     m_distributed = false;
+     m_localSystemId = 0;
+#ifdef NS3_MPI
+     if (MpiInterface::IsEnabled ())
+     {
+        m_distributed = true;
+        m_localSystemId = MpiInterface::GetSystemId ();
+     }
+#endif
+     if (!m_distributed)
+     {
+        // Everything is local when not running distributed
+        std::fill (m_systemIds.begin (), m_systemIds.end (), 0);
+     }
+     
+     // Index the slots by node id for directional sends
+     m_nodeSlots.clear ();
+     for (uint32_t slot = 0; slot < n; ++slot)
+     {
+        if (m_nodeIds[slot] >= m_nodeSlots.size ())
+        {
+           m_nodeSlots.resize (m_nodeIds[slot] + 1);
+        }
+        m_nodeSlots[m_nodeIds[slot]].push_back (slot);
+     }
+     
+     m_snapshotDirty = false;
+     m_snapshotTime = Simulator::Now ();
+     m_indexDirty = true;
+     m_staticDirty = true;
+     m_contentionDirty = true;
+     m_verletDirty = true;
+     m_octreeDirty = true;
+     m_rangesDirty = true;
+     NS_LOG_DEBUG ("Built position snapshot for " << n << " devices. moving devices: " << m_movingDevices.size ());
+  }
+  else if ( (m_snapshotTime != Simulator::Now ()) &&
+            (Simulator::Now () >= m_snapshotTime + m_positionRefreshInterval) )
+  {
+     // Moving devices are read at most once per refresh interval. Until
+     // then every send uses the positions from the last refresh.
+     for (std::set<uint32_t>::const_iterator it = m_movingDevices.begin (); it != m_movingDevices.end (); ++it)
+     {
+        Vector position = m_mobility[*it]->GetPosition ();
+        m_posX[*it] = position.x;
+        m_posY[*it] = position.y;
+        m_posZ[*it] = position.z;
+        m_posTime[*it] = Simulator::Now ();
+     }
+     m_snapshotTime = Simulator::Now ();
+  }
+}
+
+void SimpleWirelessChannel::ReadPosition (uint32_t slot)
+{
+  Ptr<MobilityModel> mobility = m_mobility[slot];
+  Vector position = mobility->GetPosition ();
+  Vector velocity = mobility->GetVelocity ();
+  
+  m_posX[slot] = position.x;
+  m_posY[slot] = position.y;
+  m_posZ[slot] = position.z;
+  m_posTime[slot] = Simulator::Now ();
+  
+  // A moving device changes position without a course change so it
+  // has to be read again every time the snapshot is updated.
+  m_deviceMoving[slot] = (velocity.x != 0) || (velocity.y != 0) || (velocity.z != 0);
+  if (m_deviceMoving[slot])
+  {
+     m_movingDevices.insert (slot);
+  }
+  else
+  {
+     m_movingDevices.erase (slot);
+  }
+  
+  // The Verlet lists are not used while a device is faster than the
+  // maximum speed, and are rebuilt once none is.
+  double speedSquared = velocity.x * velocity.x + velocity.y * velocity.y + velocity.z * velocity.z;
+  double maxSpeed = m_maxNodeSpeed * (1.0 + 1e-9);
+  if ((m_maxNodeSpeed > 0) && (speedSquared > maxSpeed * maxSpeed))
+  {
+     if (m_fastDevices.insert (slot).second)
+     {
+        NS_LOG_WARN ("Node " << m_nodeIds[slot] << " moves at " << std::sqrt (speedSquared) << " m/s, faster than MaxNodeSpeed " << m_maxNodeSpeed << ". Checking all devices.");
+     }
+  }
+  else if (m_fastDevices.erase (slot) > 0)
+  {
+     m_verletDirty = true;
+  }
+}
+
+// Squared distance from the sender to every device. This is a plain loop
+// over the position arrays so that the compiler can vectorize it.
+static inline double
+DistanceSquared (double x, double y, double z, const Vector &position)
+{
+  double dx = x - position.x;
+  double dy = y - position.y;
+  double dz = z - position.z;
+  return dx * dx + dy * dy + dz * dz;
+}
+
+void SimpleWirelessChannel::ComputeDistancesSquared (const Vector &position)
+{
+  uint32_t n = m_posX.size ();
+  m_distSq.resize (n);
+  if (n == 0)
+  {
+     return;
+  }
+  
+  const double *x = &m_posX[0];
+  const double *y = &m_posY[0];
+  const double *z = &m_posZ[0];
+  double *d = &m_distSq[0];
+  for (uint32_t i = 0; i < n; ++i)
+  {
+     d[i] = DistanceSquared (x[i], y[i], z[i], position);
+  }
+}
+
+// Squared distance from the sender to the given device slots
+void SimpleWirelessChannel::ComputeDistancesSquared (const Vector &position, const std::vector<uint32_t> &slots)
+{
+  uint32_t n = slots.size ();
+  m_distSq.resize (n);
+  for (uint32_t i = 0; i < n; ++i)
+  {
+     uint32_t slot = slots[i];
+     m_distSq[i] = DistanceSquared (m_posX[slot], m_posY[slot], m_posZ[slot], position);
+  }
+}
+
+//********************************************************************
+// Receiver thread functions
+
+// Compute the squared distance and error rate of every candidate using
+// the receiver threads. Nothing here draws random values.
+void SimpleWirelessChannel::EvaluateReceiversParallel (const Vector &position, bool indexed, uint32_t count, double limitSquared)
+{
+  if (m_threadPoolSize != m_receiverThreads)
+  {
+     m_threadPool = Create<ChannelThreadPool> (m_receiverThreads);
+     m_threadPoolSize = m_receiverThreads;
+  }
+  
+  // The threads only read the PER table so it must be built first
+  if ( (m_ErrorModel == PER_CURVE) && (m_perTableDirty || (m_perBuiltResolution != m_perResolution)) )
+  {
+     BuildPERTable ();
+  }
+  
+  m_distSq.resize (count);
+  m_errorRates.resize (count);
+  m_parallelPosition = position;
+  m_parallelIndexed = indexed;
+  m_parallelLimitSquared = limitSquared;
+  m_threadPool->Run (MakeCallback (&SimpleWirelessChannel::EvaluateReceivers, this), count);
+}
+
+// Job for one chunk of candidates. Called from the receiver threads so
+// it must not change anything but its own entries and must not log.
+void SimpleWirelessChannel::EvaluateReceivers (uint32_t begin, uint32_t end)
+{
+  for (uint32_t k = begin; k < end; ++k)
+  {
+     uint32_t slot = m_parallelIndexed ? m_candidates[k] : k;
+     double distanceSquared = DistanceSquared (m_posX[slot], m_posY[slot], m_posZ[slot], m_parallelPosition);
+     m_distSq[k] = distanceSquared;
+     
+     double errorRate = NEVER_IN_ERROR;
+     if (distanceSquared <= m_parallelLimitSquared)
+     {
+        if (m_ErrorModel == CONSTANT)
+        {
+           errorRate = m_errorRate;
+        }
+        else if (m_ErrorModel == PER_CURVE)
+        {
+           uint32_t up;
+           errorRate = FindPERCurve (std::sqrt (distanceSquared), up);
+        }
+     }
+     m_errorRates[k] = errorRate;
+  }
+}
+
+void SimpleWirelessChannel::CourseChanged (Ptr<const MobilityModel> model)
+{
+  // Nothing to do if the whole snapshot is rebuilt before the next send
+  if (m_snapshotDirty)
+  {
+     return;
+  }
+  
+  std::map<const MobilityModel *, std::vector<uint32_t> >::const_iterator it = m_mobilitySlots.find (PeekPointer (model));
+  if (it == m_mobilitySlots.end ())
+  {
+     return;
+  }
+  
+  // Precomputed receivers are no longer valid
+  m_staticDirty = true;
+  
+  bool reindex = (m_spatialIndex == SPATIAL_INDEX_GRID) && !m_indexDirty;
+  for (std::vector<uint32_t>::const_iterator slot = it->second.begin (); slot != it->second.end (); ++slot)
+  {
+     if (reindex)
+     {
+        UnindexDevice (*slot);
+     }
+     double oldX = m_posX[*slot];
+     double oldY = m_posY[*slot];
+     double oldZ = m_posZ[*slot];
+     Time oldTime = m_posTime[*slot];
+     ReadPosition (*slot);
+     if (reindex)
+     {
+        IndexDevice (*slot);
+     }
+     UpdateOctreeDrift (*slot);
+     UpdateContentionSlot (*slot);
+     
+     // The neighbor lists only hold if no device moves faster than the
+     // maximum speed. A device that jumped (SetPosition) invalidates them.
+     double dx = m_posX[*slot] - oldX;
+     double dy = m_posY[*slot] - oldY;
+     double dz = m_posZ[*slot] - oldZ;
+     double allowed = m_maxNodeSpeed * (Simulator::Now () - oldTime).GetSeconds () * (1.0 + 1e-9) + 1e-9;
+     if ( (dx * dx + dy * dy + dz * dz) > (allowed * allowed) )
+     {
+        NS_LOG_DEBUG ("Device in slot " << *slot << " moved faster than MaxNodeSpeed. Rebuilding neighbor lists.");
+        m_verletDirty = true;
+     }
+  }
+}
+
+
+//********************************************************************
+// Static topology functions
+
+// Make sure the precomputed receivers are valid for the current
+// configuration. Returns false if they can not be used because some
+// devices are moving, in which case the receivers are found on each send.
+bool SimpleWirelessChannel::PrepareStaticTopology (void)
+{
+  if (!m_movingDevices.empty ())
+  {
+     NS_LOG_DEBUG ("Static topology enabled but " << m_movingDevices.size () << " devices are moving");
+     return false;
+  }
+  
+  if (m_staticDirty || (m_staticRange != m_range) || (m_staticContentionEnabled != m_fixedContentionEnabled)
+      || (m_staticContentionRange != m_fixedContentionRange) || (m_staticErrorModel != m_ErrorModel)
+      || (m_staticErrorRate != m_errorRate))
+  {
+     // Receivers are built per sender the first time the sender sends
+     m_staticReceivers.clear ();
+     m_staticReceivers.resize (m_devices.size ());
+     m_staticBuilt.assign (m_devices.size (), false);
+     m_staticRange = m_range;
+     m_staticContentionEnabled = m_fixedContentionEnabled;
+     m_staticContentionRange = m_fixedContentionRange;
+     m_staticErrorModel = m_ErrorModel;
+     m_staticErrorRate = m_errorRate;
+     m_staticDirty = false;
+     NS_LOG_DEBUG ("Cleared precomputed receivers for " << m_devices.size () << " devices");
+  }
+  return true;
+}
+
+// Find every device within the transmission range or the contention range
+// of the sender and save the distance, delay and error rate for it.
+void SimpleWirelessChannel::BuildStaticReceivers (uint32_t senderSlot)
+{
+  Vector position (m_posX[senderSlot], m_posY[senderSlot], m_posZ[senderSlot]);
+  
+  double range = GetTxRange (m_devices[senderSlot]);
+  double limit = range;
+  if (m_fixedContentionEnabled && (m_fixedContentionRange > limit))
+    {
+      limit = m_fixedContentionRange;
+    }
+  double limitSquared = limit * limit * (1.0 + 1e-9);
+  
+  bool indexed = false;
+  if ((m_spatialIndex == SPATIAL_INDEX_GRID) && PrepareSpatialIndex ())
+    {
+      indexed = true;
+      GetCandidateDevices (position, m_candidates);
+    }
+  else if ((m_spatialIndex == SPATIAL_INDEX_OCTREE) && PrepareOctree ())
+    {
+      indexed = true;
+      GetOctreeCandidates (position, limit + m_octreeDrift, m_candidates);
+    }
+  
+  uint32_t count;
+  if (indexed)
+    {
+      ComputeDistancesSquared (position, m_candidates);
+      count = m_candidates.size ();
+    }
+  else
+    {
+      ComputeDistancesSquared (position);
+      count = m_devices.size ();
+    }
+  
+  std::vector<StaticReceiver> &receivers = m_staticReceivers[senderSlot];
+  receivers.clear ();
+  for (uint32_t k = 0; k < count; ++k)
+    {
+      uint32_t slot = indexed ? m_candidates[k] : k;
+      if ( (slot == senderSlot) || (m_distSq[k] > limitSquared) )
+        {
+          continue;
+        }
+      
+      StaticReceiver receiver;
+      receiver.slot = slot;
+      receiver.distance = std::sqrt (m_distSq[k]);
+      receiver.inContention = m_fixedContentionEnabled && (receiver.distance < m_fixedContentionRange);
+      receiver.inRange = !(receiver.distance > range);
+      if (!receiver.inContention && !receiver.inRange)
+        {
+          continue;
+        }
+      
+      // propagation delay. speed of light is 3.3 ns/meter
+      receiver.propDelay = 3.3 * receiver.distance;
+      receivers.push_back (receiver);
+    }
+  
+  // Look up the error rates for all the receivers at once
+  std::vector<double> distances (receivers.size ());
+  std::vector<double> errorRates;
+  for (uint32_t i = 0; i < receivers.size (); ++i)
+    {
+      distances[i] = receivers[i].distance;
+    }
+  GetPacketErrorRates (distances, errorRates);
+  for (uint32_t i = 0; i < receivers.size (); ++i)
+    {
+      receivers[i].errorRate = receivers[i].inRange ? errorRates[i] : NEVER_IN_ERROR;
+    }
+  
+  m_staticBuilt[senderSlot] = true;
+  NS_LOG_DEBUG ("Node " << m_nodeIds[senderSlot] << " has " << receivers.size () << " precomputed receivers");
+}
+
+void SimpleWirelessChannel::SendStatic (Ptr<const Packet> p, uint16_t protocol,
+                                        Mac48Address to, Mac48Address from,
+                                        Ptr<SimpleWirelessNetDevice> sender, Time txTime, uint32_t destId)
+{
+  std::map<const SimpleWirelessNetDevice *, uint32_t>::const_iterator it = m_deviceSlots.find (PeekPointer (sender));
+  NS_ASSERT_MSG (it != m_deviceSlots.end (), "Sender is not on this channel");
+  uint32_t senderSlot = it->second;
+  uint32_t senderNodeId = m_nodeIds[senderSlot];
+  
+  if (!m_staticBuilt[senderSlot])
+    {
+      BuildStaticReceivers (senderSlot);
+    }
+  
+  const std::vector<StaticReceiver> &receivers = m_staticReceivers[senderSlot];
+  for (std::vector<StaticReceiver>::const_iterator r = receivers.begin (); r != receivers.end (); ++r)
+    {
+      uint32_t destNodeId = m_nodeIds[r->slot];
+      
+      // See if we have directional networking enabled and if so if this is destination node
+      if ( (destId != NO_DIRECTIONAL_NBR) && (destNodeId != destId) )
+        {
+          continue;
+        }
+      
+      // See if we are using stochastic. If so see if the sender's link
+      // to the destination is up or down
+      if (CheckStochasticError (senderNodeId, destNodeId))
+        {
+          NS_LOG_INFO ("Node " << senderNodeId << " NOT sending to node " << destNodeId << ". Stochastic error enabled and link to node is in OFF state");
+          continue;
+        }
+      
+      // if fixed contention is enabled then we need to peg the neighbor count
+      if (r->inContention && m_contentionInterval.IsZero ())
+        {
+          sender->IncrementNbrCount();
+        }
+      
+      if (!r->inRange)
+        {
+          continue;
+        }
+      
+      // Draw the value of the shared stream also for a device that would
+      // only throw the frame away, as in SendToDevices
+      if (m_directSend && !IsDirectReceiver (r->slot, to))
+        {
+          if (!m_perLinkErrorStreams)
+            {
+              DrawPacketError (r->errorRate, r->distance, senderNodeId, destNodeId);
+            }
+          continue;
+        }
+      
+      if (DrawPacketError (r->errorRate, r->distance, senderNodeId, destNodeId))
+        {
+          continue;
+        }
+      
+      NS_LOG_INFO ("Node " << senderNodeId << " sending to node " << destNodeId 
+        << " at distance " << r->distance << " meters; time (ns): "<< Simulator::Now().GetNanoSeconds ()
+        << " txDelay: " << txTime << "  propDelay: " << r->propDelay);
+      
+      ScheduleReceive (p, protocol, to, from, r->slot, NanoSeconds (txTime + r->propDelay));
+    }
+}
+
+
+//********************************************************************
+// Direct unicast functions
+
+// Make sure the address index is up to date. Returns true if a frame
+// to this address only has to go to the direct receivers.
+bool SimpleWirelessChannel::PrepareDirectUnicast (Mac48Address to)
+{
+  if (to.IsGroup ())
+    {
+      return false;
+    }
+  
+  if (m_directDirty)
+    {
+      m_addresses.resize (m_devices.size ());
+      m_listener.resize (m_devices.size ());
+      m_addressSlots.clear ();
+      m_listenerSlots.clear ();
+      for (uint32_t slot = 0; slot < m_devices.size (); ++slot)
+        {
+          m_addresses[slot] = Mac48Address::ConvertFrom (m_devices[slot]->GetAddress ());
+          m_listener[slot] = m_devices[slot]->NeedsAllFrames ();
+          m_addressSlots[m_addresses[slot]].push_back (slot);
+          if (m_listener[slot])
+            {
+              m_listenerSlots.push_back (slot);
+            }
+        }
+      m_directDirty = false;
+      NS_LOG_DEBUG ("Rebuilt address index for " << m_devices.size () << " devices. listeners: " << m_listenerSlots.size ());
+    }
+  return true;
+}
+
+bool SimpleWirelessChannel::IsDirectReceiver (uint32_t slot, Mac48Address to) const
+{
+  return m_listener[slot] || (m_addresses[slot] == to);
+}
+
+// Build the sorted list of device slots that keep a unicast frame to
+// the given address.
+void SimpleWirelessChannel::GetDirectReceivers (Mac48Address to, std::vector<uint32_t> &slots)
+{
+  slots = m_listenerSlots;
+  std::map<Mac48Address, std::vector<uint32_t> >::const_iterator it = m_addressSlots.find (to);
+  if (it != m_addressSlots.end ())
+    {
+      slots.insert (slots.end (), it->second.begin (), it->second.end ());
+      std::sort (slots.begin (), slots.end ());
+      slots.erase (std::unique (slots.begin (), slots.end ()), slots.end ());
+    }
+}
+
+
+//********************************************************************
+// Spatial index functions
+
+// Make sure the spatial index is up to date. Returns false if the
+// index can not be used, in which case all devices are checked.
+bool SimpleWirelessChannel::PrepareSpatialIndex (void)
+{
+  // The grid cells must cover both the largest transmission range and the
+  // contention range so that the neighbor count for fixed contention
+  // is the same as without the index.
+  double cellSize = GetLargestTxRange ();
+  if (m_fixedContentionEnabled && (m_fixedContentionRange > cellSize))
+  {
+     cellSize = m_fixedContentionRange;
+  }
+  
+  if (cellSize <= 0)
+  {
+     return false;
+  }
+  
+  // Rebuild if devices were added or if the ranges changed
+  if (m_indexDirty || (cellSize != m_cellSize))
+  {
+     RebuildSpatialIndex (cellSize);
+  }
+  return true;
+}
+
+void SimpleWirelessChannel::RebuildSpatialIndex (double cellSize)
+{
+  NS_LOG_FUNCTION (this << cellSize);
+  
+  m_cellSize = cellSize;
+  m_grid.clear ();
+  m_deviceCell.resize (m_devices.size ());
+  
+  for (uint32_t slot = 0; slot < m_devices.size (); ++slot)
+  {
+     IndexDevice (slot);
+  }
+  
+  m_indexDirty = false;
+  NS_LOG_DEBUG ("Rebuilt spatial index for " << m_devices.size () << " devices. cell size: " << m_cellSize 
+                << " cells: " << m_grid.size ());
+}
+
+// Moving devices are not binned. They are added to the candidates
+// on every send from the snapshot's list of moving devices.
+void SimpleWirelessChannel::IndexDevice (uint32_t slot)
+{
+  if (!m_deviceMoving[slot])
+  {
+     m_deviceCell[slot] = GetGridCell (m_posX[slot], m_posY[slot]);
+     m_grid[m_deviceCell[slot]].push_back (slot);
+  }
+}
+
+void SimpleWirelessChannel::UnindexDevice (uint32_t slot)
+{
+  if (m_deviceMoving[slot])
+  {
+     return;
+  }
+  
+  std::map<GridCell, std::vector<uint32_t> >::iterator cell = m_grid.find (m_deviceCell[slot]);
+  NS_ASSERT (cell != m_grid.end ());
+  std::vector<uint32_t>::iterator it = std::find (cell->second.begin (), cell->second.end (), slot);
+  NS_ASSERT (it != cell->second.end ());
+  *it = cell->second.back ();
+  cell->second.pop_back ();
+  if (cell->second.empty ())
+  {
+     m_grid.erase (cell);
+  }
+}
+
+GridCell SimpleWirelessChannel::GetGridCell (double x, double y) const
+{
+  return GridCell (static_cast<int32_t> (std::floor (x / m_cellSize)),
+                   static_cast<int32_t> (std::floor (y / m_cellSize)));
+}
+
+// Build the sorted list of device slots that could be in range of
+// a sender at the given position.
+void SimpleWirelessChannel::GetCandidateDevices (const Vector &position, std::vector<uint32_t> &candidates)
+{
+  candidates.clear ();
+  GridCell center = GetGridCell (position.x, position.y);
+  
+  for (int32_t x = center.first - 1; x <= center.first + 1; ++x)
+  {
+     for (int32_t y = center.second - 1; y <= center.second + 1; ++y)
+     {
+        std::map<GridCell, std::vector<uint32_t> >::const_iterator cell = m_grid.find (GridCell (x, y));
+        if (cell != m_grid.end ())
+        {
+           candidates.insert (candidates.end (), cell->second.begin (), cell->second.end ());
+        }
+     }
+  }
+  candidates.insert (candidates.end (), m_movingDevices.begin (), m_movingDevices.end ());
+  std::sort (candidates.begin (), candidates.end ());
+}
+
+
+// The transmission range of a device. Devices without their own range
+// use the range of the channel.
+double SimpleWirelessChannel::GetTxRange (Ptr<SimpleWirelessNetDevice> device) const
+{
+  double range = device->GetMaxRange ();
+  return (range > 0) ? range : m_range;
+}
+
+double SimpleWirelessChannel::GetLargestTxRange (void)
+{
+  if (m_rangesDirty || (m_largestRangeDefault != m_range))
+  {
+     m_largestRange = 0;
+     for (uint32_t slot = 0; slot < m_devices.size (); ++slot)
+     {
+        m_largestRange = std::max (m_largestRange, GetTxRange (m_devices[slot]));
+     }
+     m_largestRangeDefault = m_range;
+     m_rangesDirty = false;
+  }
+  return m_largestRange;
+}
+
+
+//********************************************************************
+// Octree functions
+
+// Make sure the octree is up to date. Returns false if the octree can
+// not be used, in which case all devices are checked.
+bool SimpleWirelessChannel::PrepareOctree (void)
+{
+  if (m_devices.empty ())
+  {
+     return false;
+  }
+  
+  // The tree keeps the positions it was built with. Searches are made
+  // larger by how far any device has moved since, and the tree is only
+  // rebuilt once that is more than the slack.
+  if (!m_octreeDirty && (m_octreeTime != m_snapshotTime))
+  {
+     for (std::set<uint32_t>::const_iterator it = m_movingDevices.begin (); it != m_movingDevices.end (); ++it)
+     {
+        UpdateOctreeDrift (*it);
+     }
+     m_octreeTime = m_snapshotTime;
+  }
+  
+  if (m_octreeDirty || (m_octreeDrift > m_octreeSlack))
+  {
+     RebuildOctree ();
+  }
+  return true;
+}
+
+// Keep the largest distance a device has moved from the position the
+// octree was built with.
+void SimpleWirelessChannel::UpdateOctreeDrift (uint32_t slot)
+{
+  if (m_octreeDirty || (slot >= m_octreeX.size ()))
+  {
+     m_octreeDirty = true;
+     return;
+  }
+  double dx = m_posX[slot] - m_octreeX[slot];
+  double dy = m_posY[slot] - m_octreeY[slot];
+  double dz = m_posZ[slot] - m_octreeZ[slot];
+  double drift = std::sqrt (dx * dx + dy * dy + dz * dz);
+  if (drift > m_octreeDrift)
+  {
+     m_octreeDrift = drift;
+  }
+}
+
+void SimpleWirelessChannel::RebuildOctree (void)
+{
+  NS_LOG_FUNCTION (this);
+  
+  uint32_t n = m_devices.size ();
+  m_octree.clear ();
+  m_octreeSlots.resize (n);
+  m_octreeOctants.resize (n);
+  m_octreeSorted.resize (n);
+  for (uint32_t slot = 0; slot < n; ++slot)
+  {
+     m_octreeSlots[slot] = slot;
+  }
+  BuildOctreeNode (0, n, 0);
+  
+  m_octreeX = m_posX;
+  m_octreeY = m_posY;
+  m_octreeZ = m_posZ;
+  m_octreeDrift = 0;
+  m_octreeDirty = false;
+  m_octreeTime = m_snapshotTime;
+  NS_LOG_DEBUG ("Rebuilt octree for " << n << " devices. nodes: " << m_octree.size ());
+}
+
+// Build the node for the slots in m_octreeSlots [begin, end) and return
+// its index. The slots are reordered so that each child's slots are
+// contiguous. The node bounds are the tight bounds of its devices, so
+// clusters get deep nodes and empty space gets none.
+uint32_t SimpleWirelessChannel::BuildOctreeNode (uint32_t begin, uint32_t end, uint32_t depth)
+{
+  OctreeNode node;
+  node.begin = begin;
+  node.end = end;
+  node.leaf = true;
+  for (uint32_t i = 0; i < 8; ++i)
+  {
+     node.child[i] = 0;
+  }
+  
+  uint32_t first = m_octreeSlots[begin];
+  node.lo[0] = node.hi[0] = m_posX[first];
+  node.lo[1] = node.hi[1] = m_posY[first];
+  node.lo[2] = node.hi[2] = m_posZ[first];
+  for (uint32_t i = begin + 1; i < end; ++i)
+  {
+     uint32_t slot = m_octreeSlots[i];
+     node.lo[0] = std::min (node.lo[0], m_posX[slot]);
+     node.hi[0] = std::max (node.hi[0], m_posX[slot]);
+     node.lo[1] = std::min (node.lo[1], m_posY[slot]);
+     node.hi[1] = std::max (node.hi[1], m_posY[slot]);
+     node.lo[2] = std::min (node.lo[2], m_posZ[slot]);
+     node.hi[2] = std::max (node.hi[2], m_posZ[slot]);
+  }
+  
+  uint32_t index = m_octree.size ();
+  m_octree.push_back (node);
+  
+  // Devices at the same position can not be split
+  bool point = (node.lo[0] == node.hi[0]) && (node.lo[1] == node.hi[1]) && (node.lo[2] == node.hi[2]);
+  if ((end - begin <= OCTREE_LEAF_SIZE) || (depth >= OCTREE_MAX_DEPTH) || point)
+  {
+     return index;
+  }
+  
+  // Split the slots into the eight octants around the center of the bounds
+  double cx = (node.lo[0] + node.hi[0]) / 2;
+  double cy = (node.lo[1] + node.hi[1]) / 2;
+  double cz = (node.lo[2] + node.hi[2]) / 2;
+  uint32_t counts[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  for (uint32_t i = begin; i < end; ++i)
+  {
+     uint32_t slot = m_octreeSlots[i];
+     uint32_t octant = ((m_posX[slot] > cx) ? 1 : 0) | ((m_posY[slot] > cy) ? 2 : 0) | ((m_posZ[slot] > cz) ? 4 : 0);
+     m_octreeOctants[i] = octant;
+     counts[octant]++;
+  }
+  
+  uint32_t starts[8];
+  uint32_t next[8];
+  uint32_t offset = begin;
+  for (uint32_t octant = 0; octant < 8; ++octant)
+  {
+     starts[octant] = next[octant] = offset;
+     offset += counts[octant];
+  }
+  
+  // Counting sort of the slots by octant
+  for (uint32_t i = begin; i < end; ++i)
+  {
+     m_octreeSorted[next[m_octreeOctants[i]]++] = m_octreeSlots[i];
+  }
+  std::copy (m_octreeSorted.begin () + begin, m_octreeSorted.begin () + end, m_octreeSlots.begin () + begin);
+  
+  m_octree[index].leaf = false;
+  for (uint32_t octant = 0; octant < 8; ++octant)
+  {
+     if (counts[octant] > 0)
+     {
+        uint32_t child = BuildOctreeNode (starts[octant], starts[octant] + counts[octant], depth + 1);
+        m_octree[index].child[octant] = child;
+     }
+  }
+  return index;
+}
+
+// Build the sorted list of device slots that could be within the
+// limit of a sender at the given position.
+void SimpleWirelessChannel::GetOctreeCandidates (const Vector &position, double limit, std::vector<uint32_t> &candidates)
+{
+  candidates.clear ();
+  double limitSquared = limit * limit * (1.0 + 1e-9);
+  
+  m_octreeStack.clear ();
+  m_octreeStack.push_back (0);
+  while (!m_octreeStack.empty ())
+  {
+     const OctreeNode &node = m_octree[m_octreeStack.back ()];
+     m_octreeStack.pop_back ();
+     
+     // Squared distance from the sender to the nearest and the
+     // farthest point of the node's bounds
+     double p[3] = {position.x, position.y, position.z};
+     double nearSquared = 0;
+     double farSquared = 0;
+     for (uint32_t axis = 0; axis < 3; ++axis)
+     {
+        double below = node.lo[axis] - p[axis];
+        double above = p[axis] - node.hi[axis];
+        double nearest = std::max (0.0, std::max (below, above));
+        double farthest = std::max (std::fabs (below), std::fabs (above));
+        nearSquared += nearest * nearest;
+        farSquared += farthest * farthest;
+     }
+     
+     if (nearSquared > limitSquared)
+     {
+        continue;
+     }
+     if (node.leaf || (farSquared <= limitSquared))
+     {
+        candidates.insert (candidates.end (), m_octreeSlots.begin () + node.begin, m_octreeSlots.begin () + node.end);
+        continue;
+     }
+     for (uint32_t octant = 0; octant < 8; ++octant)
+     {
+        if (node.child[octant] != 0)
+        {
+           m_octreeStack.push_back (node.child[octant]);
+        }
+     }
+  }
+  std::sort (candidates.begin (), candidates.end ());
+}
+
+
+// Get the slots of the devices of a node. They are in slot order.
+void SimpleWirelessChannel::GetNodeDevices (uint32_t nodeId, std::vector<uint32_t> &candidates) const
+{
+  if (nodeId < m_nodeSlots.size ())
+  {
+     candidates = m_nodeSlots[nodeId];
+  }
+  else
+  {
+     candidates.clear ();
+  }
+}
+
+
+//********************************************************************
+// Neighbor list functions
+
+// Make sure the neighbor lists can be used for the given limit. Returns
+// false if they can not, in which case all devices are checked.
+bool SimpleWirelessChannel::PrepareVerletLists (void)
+{
+  // Without a speed bound the lists only hold if nothing moves
+  if ( (m_maxNodeSpeed <= 0) && !m_movingDevices.empty () )
+  {
+     return false;
+  }
+  
+  // Nor while some device is faster than the bound
+  if (!m_fastDevices.empty ())
+  {
+     return false;
+  }
+  
+  if (m_verletDirty || (m_verletLists.size () != m_devices.size ()))
+  {
+     m_verletLists.assign (m_devices.size (), std::vector<uint32_t> ());
+     m_verletLimits.assign (m_devices.size (), -1.0);
+     m_verletTime.resize (m_devices.size ());
+     m_verletDirty = false;
+  }
+  return true;
+}
+
+// Get the devices that could be within the limit of the sender. The
+// sender's list is rebuilt when two devices moving toward each other
+// at the maximum speed could have closed the skin since it was built,
+// or when the sender's limit changed.
+void SimpleWirelessChannel::GetVerletCandidates (Ptr<SimpleWirelessNetDevice> sender, double limit, std::vector<uint32_t> &candidates)
+{
+  std::map<const SimpleWirelessNetDevice *, uint32_t>::const_iterator it = m_deviceSlots.find (PeekPointer (sender));
+  NS_ASSERT_MSG (it != m_deviceSlots.end (), "Sender is not on this channel");
+  uint32_t senderSlot = it->second;
+  
+  Time now = Simulator::Now ();
+  // The positions may be up to a refresh interval old, so that is added
+  // to the time the devices could have been moving.
+  double elapsed = (now - m_verletTime[senderSlot] + m_positionRefreshInterval).GetSeconds ();
+  if ((m_verletLimits[senderSlot] != limit) || (2 * m_maxNodeSpeed * elapsed > m_verletSkin))
+  {
+     Vector position (m_posX[senderSlot], m_posY[senderSlot], m_posZ[senderSlot]);
+     ComputeDistancesSquared (position);
+     double cutoff = limit + m_verletSkin;
+     double cutoffSquared = cutoff * cutoff * (1.0 + 1e-9);
+     
+     std::vector<uint32_t> &list = m_verletLists[senderSlot];
+     list.clear ();
+     for (uint32_t slot = 0; slot < m_devices.size (); ++slot)
+     {
+        if (m_distSq[slot] <= cutoffSquared)
+        {
+           list.push_back (slot);
+        }
+     }
+     m_verletLimits[senderSlot] = limit;
+     m_verletTime[senderSlot] = now;
+     NS_LOG_DEBUG ("Built neighbor list for slot " << senderSlot << " with " << list.size () << " devices");
+  }
+  candidates = m_verletLists[senderSlot];
+}
+
+
+//********************************************************************
+// contention functions
+void SimpleWirelessChannel::EnableFixedContention(void)
+{
+  m_fixedContentionEnabled = true;
+  m_contentionDirty = true;
+  
+  // Set up all the devices to support contention.
+  // IMPORTANT NOTE: There may not be any devices at this point on the channel.
+  // If there are not any, then the first packet sent by the device will use the
+  // full data rate and will not use contention. That is, the device will be notified
+  // by the channel when the channel gets the first packet from the device and that is
+  // after the data rate has been used to set the tx time. All subsequent packets sent
+  // by the device will use contention just not the first one.
+  for (std::vector<Ptr<SimpleWirelessNetDevice> >::const_iterator i = m_devices.begin (); i != m_devices.end (); ++i)
+  {
+    Ptr<SimpleWirelessNetDevice> tmp = *i;
+    tmp->ClearNbrCount();
+  }
+}
+  
+void SimpleWirelessChannel::SetFixedContentionRange(double range)
+{
+  m_fixedContentionRange = range;
+}
+
+// Recompute the neighbor count of every device if devices were added,
+// or if the update interval has passed and some devices are moving.
+// Each device counts itself and every other device closer than the
+// contention range.
+void SimpleWirelessChannel::UpdateContention(void)
+{
+  if (!m_fixedContentionEnabled || m_contentionInterval.IsZero ())
+  {
+     return;
+  }
+  
+  if (m_fixedContentionRange == 0)
+  {
+     m_fixedContentionRange = m_range;
+  }
+  
+  UpdatePositionSnapshot ();
+  
+  Time now = Simulator::Now ();
+  bool expired = !m_movingDevices.empty () && (now >= m_contentionTime + m_contentionInterval);
+  if (!m_contentionDirty && !expired && (m_contentionRange == m_fixedContentionRange))
+  {
+     return;
+  }
+  
+  uint32_t n = m_devices.size ();
+  bool grid = (m_spatialIndex == SPATIAL_INDEX_GRID) && PrepareSpatialIndex ();
+  bool octree = (m_spatialIndex == SPATIAL_INDEX_OCTREE) && PrepareOctree ();
+  bool indexed = grid || octree;
+  double limitSquared = m_fixedContentionRange * m_fixedContentionRange * (1.0 + 1e-9);
+  m_contentionCounts.resize (n);
+  for (uint32_t slot = 0; slot < n; ++slot)
+  {
+     Vector position (m_posX[slot], m_posY[slot], m_posZ[slot]);
+     uint32_t count;
+     if (indexed)
+     {
+        if (grid)
+        {
+           GetCandidateDevices (position, m_candidates);
+        }
+        else
+        {
+           GetOctreeCandidates (position, m_fixedContentionRange + m_octreeDrift, m_candidates);
+        }
+        ComputeDistancesSquared (position, m_candidates);
+        count = m_candidates.size ();
+     }
+     else
+     {
+        ComputeDistancesSquared (position);
+        count = n;
+     }
+     
+     int nbrCount = 1;
+     for (uint32_t k = 0; k < count; ++k)
+     {
+        uint32_t other = indexed ? m_candidates[k] : k;
+        if ( (other != slot) && (m_distSq[k] <= limitSquared) &&
+             (std::sqrt (m_distSq[k]) < m_fixedContentionRange) )
+        {
+           nbrCount++;
+        }
+     }
+     m_devices[slot]->SetNbrCount (nbrCount);
+     m_contentionCounts[slot] = nbrCount;
+  }
+  
+  m_contentionX = m_posX;
+  m_contentionY = m_posY;
+  m_contentionZ = m_posZ;
+  m_contentionDirty = false;
+  m_contentionTime = now;
+  m_contentionRange = m_fixedContentionRange;
+  NS_LOG_DEBUG ("Updated neighbor counts for " << n << " devices. contention range: " << m_contentionRange);
+}
+
+// Update the neighbor counts after the device in the slot changed
+// course. Only the devices it stops or starts being a neighbor of
+// change their count, so the other devices keep the counts of the last
+// recount.
+void SimpleWirelessChannel::UpdateContentionSlot(uint32_t slot)
+{
+  if (!m_fixedContentionEnabled || m_contentionInterval.IsZero () || m_contentionDirty ||
+      (m_contentionRange != m_fixedContentionRange) || (m_contentionCounts.size () != m_devices.size ()))
+  {
+     m_contentionDirty = true;
+     return;
+  }
+  
+  double limitSquared = m_contentionRange * m_contentionRange * (1.0 + 1e-9);
+  for (uint32_t other = 0; other < m_devices.size (); ++other)
+  {
+     if (other == slot)
+     {
+        continue;
+     }
+     
+     double dx = m_contentionX[slot] - m_contentionX[other];
+     double dy = m_contentionY[slot] - m_contentionY[other];
+     double dz = m_contentionZ[slot] - m_contentionZ[other];
+     double distanceSquared = dx * dx + dy * dy + dz * dz;
+     bool wasNbr = (distanceSquared <= limitSquared) && (std::sqrt (distanceSquared) < m_contentionRange);
+     
+     dx = m_posX[slot] - m_contentionX[other];
+     dy = m_posY[slot] - m_contentionY[other];
+     dz = m_posZ[slot] - m_contentionZ[other];
+     distanceSquared = dx * dx + dy * dy + dz * dz;
+     bool isNbr = (distanceSquared <= limitSquared) && (std::sqrt (distanceSquared) < m_contentionRange);
+     
+     if (wasNbr != isNbr)
+     {
+        int change = isNbr ? 1 : -1;
+        m_contentionCounts[other] += change;
+        m_contentionCounts[slot] += change;
+        m_devices[other]->SetNbrCount (m_contentionCounts[other]);
+     }
+  }
+  
+  m_devices[slot]->SetNbrCount (m_contentionCounts[slot]);
+  m_contentionX[slot] = m_posX[slot];
+  m_contentionY[slot] = m_posY[slot];
+  m_contentionZ[slot] = m_posZ[slot];
+}
+
+//********************************************************************
+// Error Model functions
+void SimpleWirelessChannel::setErrorModelType(ErrorModelType type) 
+{
+  m_ErrorModel = type;
+  
+  // reset range to 0 if error model is PER CURVE so that
+  // we can compare to distances added to the curve to
+  // get the max range
+  if (m_ErrorModel == PER_CURVE)
+  {
+     m_range = 0;
+  }
+}
+
+void SimpleWirelessChannel::setErrorRate(double error) 
+{
+  m_errorRate = error;
+}
+
+void SimpleWirelessChannel::addToPERmodel(double distance, double error)
+{
+  // NOTE: distance is in meters
+  mPERmap.insert(std::pair<double, double>(distance, error));
+  m_perTableDirty = true;
+  m_staticDirty = true;
+  
+  if (distance > m_range)
+  {
+     m_range = distance;
+  }
+}
+
+
+//********************************************************************
+// Stochastic error functions
+
+void SimpleWirelessChannel::InitStochasticModel()
+{
+  // Build the map of neighbor links, setting all links to
+  // ON state and pick a duration for that state.
+  if (m_ErrorModel == STOCHASTIC)
+  {
+     InitStochasticRandom ();
+     m_StochasticLinks.SetStorage (m_stochasticStorage);
+     
+     // In lazy mode each link is created the first time it is checked
+     if (m_stochasticLazy)
+     {
+        return;
+     }
+     
+     if (m_devices.size() == 0)
+     {
+        NS_LOG_ERROR ("InitStochasticModel called but there are no devices on the channel. Be sure to call InitStochasticModel AFTER devices have been added.");
+     }
+     
+     Time currTime = Simulator::Now();
      
+     std::vector<uint32_t> nodeIds;
      for (std::vector<Ptr<SimpleWirelessNetDevice> >::const_iterator i = m_devices.begin (); i != m_devices.end (); ++i)
      {
-        for (std::vector<Ptr<SimpleWirelessNetDevice> >::const_iterator j = m_devices.begin (); j != m_devices.end (); ++j)
+        nodeIds.push_back ((*i)->GetNode()->GetId());
+     }
+     m_StochasticLinks.AddNodes (nodeIds);
+     
+     for (std::vector<uint32_t>::const_iterator i = nodeIds.begin (); i != nodeIds.end (); ++i)
+     {
+        for (std::vector<uint32_t>::const_iterator j = nodeIds.begin (); j != nodeIds.end (); ++j)
         {
-           int src = (*i)->GetNode()->GetId();
-           int dst = (*j)->GetNode()->GetId();
+           uint32_t src = *i;
+           uint32_t dst = *j;
            
            if (src == dst)
               continue;
@@ -295,7 +1988,12 @@ void SimpleWirelessChannel::InitStochasticModel()
            tempLink.stateExpireTime = currTime + MicroSeconds(m_randomUp->GetValue());
            //tempLink.stateExpireTime = Simulator::Now() + Seconds(1.0);
            
-           m_StochasticLinks.insert(std::pair<StochasticKey, StochasticLink>(StochasticKey(src,dst), tempLink));
+           // A node with more than one device on the channel keeps the first link
+           uint64_t *link = m_StochasticLinks.Insert (src, dst);
+           if (*link == StochasticLinkTable::NO_LINK)
+           {
+              *link = StochasticLinkTable::Pack (tempLink);
+           }
            NS_LOG_DEBUG("Add link to stochastic map. src: " << src << " dst: " << dst << " expireTime: " 
                       << std::setprecision (9) << tempLink.stateExpireTime.GetSeconds() << " state: " << tempLink.linkState);
         }
@@ -304,6 +2002,93 @@ void SimpleWirelessChannel::InitStochasticModel()
 }
 
 
+void SimpleWirelessChannel::InitStochasticRandom()
+{
+  m_randomUp = CreateObject<ExponentialRandomVariable> ();
+  m_randomDown = CreateObject<ExponentialRandomVariable> ();
+
+  m_randomUp->SetAttribute ("Mean", DoubleValue (m_upDuration.GetMicroSeconds()));
+  m_randomDown->SetAttribute ("Mean", DoubleValue (m_downDuration.GetMicroSeconds()));
+  if (m_streamBase >= 0)
+  {
+     m_randomUp->SetStream (m_streamBase + 1);
+     m_randomDown->SetStream (m_streamBase + 2);
+  }
+}
+
+// The stream for the initial state of lazy links and the direct catch
+// up is only created when one of them is used so that the automatic
+// stream numbers of other objects do not change otherwise.
+double SimpleWirelessChannel::GetStateUniform()
+{
+  if (m_randomState == 0)
+  {
+     m_randomState = CreateObject<UniformRandomVariable> ();
+     if (m_streamBase >= 0)
+     {
+        m_randomState->SetStream (m_streamBase + 3);
+     }
+  }
+  return m_randomState->GetValue ();
+}
+
+// The on/off link is a two state Markov chain that leaves ON at rate
+// 1/up and OFF at rate 1/down. Return the state after elapsed microseconds
+// given the starting state.
+bool SimpleWirelessChannel::SampleStochasticState(bool startState, double elapsed)
+{
+  double up = m_upDuration.GetMicroSeconds();
+  double down = m_downDuration.GetMicroSeconds();
+  
+  double pOn = up / (up + down);
+  double decay = std::exp (-elapsed * (up + down) / (up * down));
+  double pOnNow;
+  if (startState)
+  {
+     pOnNow = pOn + (1.0 - pOn) * decay;
+  }
+  else
+  {
+     pOnNow = pOn * (1.0 - decay);
+  }
+  return GetStateUniform () < pOnNow;
+}
+
+// Create a link the first time it is checked. The state is drawn from the
+// long run share of time the link spends ON and, since the durations are
+// exponential, the time left in that state has the same distribution as
+// a whole duration.
+uint64_t *SimpleWirelessChannel::CreateStochasticLink(uint32_t srcId, uint32_t dstId)
+{
+  if (m_randomUp == 0)
+  {
+     // InitStochasticModel was not called
+     InitStochasticRandom ();
+     m_StochasticLinks.SetStorage (m_stochasticStorage);
+  }
+  
+  double up = m_upDuration.GetMicroSeconds();
+  double down = m_downDuration.GetMicroSeconds();
+  
+  StochasticLink tempLink;
+  tempLink.linkState = (GetStateUniform () * (up + down)) < up;
+  if (tempLink.linkState)
+  {
+     tempLink.stateExpireTime = Simulator::Now() + MicroSeconds(m_randomUp->GetValue());
+  }
+  else
+  {
+     tempLink.stateExpireTime = Simulator::Now() + MicroSeconds(m_randomDown->GetValue());
+  }
+  
+  uint64_t *link = m_StochasticLinks.Insert (srcId, dstId);
+  *link = StochasticLinkTable::Pack (tempLink);
+  NS_LOG_DEBUG("Add link to stochastic map on first use. src: " << srcId << " dst: " << dstId << " expireTime: " 
+             << std::setprecision (9) << tempLink.stateExpireTime.GetSeconds() << " state: " << tempLink.linkState);
+  return link;
+}
+
+
 // This returns true if we should NOT send the packet.
 // That is, return true == packet fails to send
 
@@ -311,137 +2096,590 @@ bool SimpleWirelessChannel::CheckStochasticError(uint32_t srcId, uint32_t dstId)
 {
   if (m_ErrorModel == STOCHASTIC)
   {
-     // get entry from map for this src/dst pair
-     StochasIt iter = m_StochasticLinks.find(StochasticKey(srcId, dstId));
-     NS_ASSERT( iter != m_StochasticLinks.end());
-     
-     Time currTime = Simulator::Now();
-     
-     //std::cout << std::setprecision (9) << currTime.GetSeconds() << " Checking state for link src: " << srcId << " dst: " << dstId << " expireTime: " << iter->second.stateExpireTime << std::endl;
-     
-     if (currTime >= iter->second.stateExpireTime)
-     {
-        // the time at which the previous state was set to end has already passed.
-        Time endTime = iter->second.stateExpireTime;
-        bool tempState = iter->second.linkState;
-        Time newDuration;
-        // Pick the new states until we get to one that is at or greater
-        // than the current time.
-        while (endTime < currTime)
+     return StochasticLinkDown (srcId, dstId);
+  }
+  else
+  {
+     return false;
+  }
+}
+
+// Bring the state of the link up to date and return true if it is
+// OFF, in which case the packet is not sent.
+bool SimpleWirelessChannel::StochasticLinkDown(uint32_t srcId, uint32_t dstId)
+{
+  // get entry from map for this src/dst pair
+  uint64_t *entry = m_StochasticLinks.Find(srcId, dstId);
+  if ( (entry == 0) && m_stochasticLazy )
+  {
+     entry = CreateStochasticLink (srcId, dstId);
+  }
+  NS_ASSERT( entry != 0 );
+  StochasticLink link = StochasticLinkTable::Unpack (*entry);
+  
+  Time currTime = Simulator::Now();
+  
+  //std::cout << std::setprecision (9) << currTime.GetSeconds() << " Checking state for link src: " << srcId << " dst: " << dstId << " expireTime: " << link.stateExpireTime << std::endl;
+  
+  if (currTime >= link.stateExpireTime)
+  {
+     // the time at which the previous state was set to end has already passed.
+     Time endTime = link.stateExpireTime;
+     bool tempState = link.linkState;
+     Time newDuration;
+     if (m_stochasticDirectCatchUp)
+     {
+        // The link entered state !tempState at endTime. Pick the state
+        // it is in now from the transition probabilities over the time
+        // since then and draw the time left in that state.
+        tempState = SampleStochasticState (!tempState, (currTime - endTime).GetNanoSeconds () / 1000.0);
+        if (tempState)
         {
-            // Now pick duration for the new state
-            if (!tempState)
-            {
-               newDuration = MicroSeconds(m_randomUp->GetValue());
-            } 
-            else
-            {
-               newDuration = MicroSeconds(m_randomDown->GetValue());
-            }
-            endTime += newDuration;
-            tempState = !tempState;
-            
-            NS_LOG_DEBUG("---> " << std::setprecision (9) << currTime.GetSeconds() << " next state: " << tempState << " for link src: " << srcId << " dst: " << dstId 
-                    << " duration of next state: " << std::setprecision (9) << newDuration.GetSeconds()
-                    << " expireTime: " << std::setprecision (9) << endTime.GetSeconds());
-         }
-        
-        // When we get here, the new state and time are selected
-        iter->second.linkState = tempState;
-        iter->second.stateExpireTime = endTime;
-       
-        NS_LOG_DEBUG(std::setprecision (9) << currTime.GetSeconds() << " New state " << iter->second.linkState << " for link src: " << srcId << " dst: " << dstId 
-                    << " duration of next state: " << std::setprecision (9) << newDuration.GetSeconds()
-                    << " expireTime: " << std::setprecision (9) << iter->second.stateExpireTime.GetSeconds());
-        
+           newDuration = MicroSeconds(m_randomUp->GetValue());
+        } 
+        else
+        {
+           newDuration = MicroSeconds(m_randomDown->GetValue());
+        }
+        endTime = currTime + newDuration;
      }
-     else
+     // Pick the new states until we get to one that is at or greater
+     // than the current time.
+     while (endTime < currTime)
      {
-         NS_LOG_DEBUG(std::setprecision (9) << currTime.GetSeconds() << " State " << iter->second.linkState << " for link src: " << srcId << " dst: " << dstId 
-                    << " expireTime: " << std::setprecision (9) << iter->second.stateExpireTime.GetSeconds());
-     }
+         // Now pick duration for the new state
+         if (!tempState)
+         {
+            newDuration = MicroSeconds(m_randomUp->GetValue());
+         } 
+         else
+         {
+            newDuration = MicroSeconds(m_randomDown->GetValue());
+         }
+         endTime += newDuration;
+         tempState = !tempState;
+         
+         NS_LOG_DEBUG("---> " << std::setprecision (9) << currTime.GetSeconds() << " next state: " << tempState << " for link src: " << srcId << " dst: " << dstId 
+                 << " duration of next state: " << std::setprecision (9) << newDuration.GetSeconds()
+                 << " expireTime: " << std::setprecision (9) << endTime.GetSeconds());
+      }
+     
+     // When we get here, the new state and time are selected
+     link.linkState = tempState;
+     link.stateExpireTime = endTime;
+     *entry = StochasticLinkTable::Pack (link);
+    
+     NS_LOG_DEBUG(std::setprecision (9) << currTime.GetSeconds() << " New state " << link.linkState << " for link src: " << srcId << " dst: " << dstId 
+                 << " duration of next state: " << std::setprecision (9) << newDuration.GetSeconds()
+                 << " expireTime: " << std::setprecision (9) << link.stateExpireTime.GetSeconds());
      
-     // now return true or false depending on state
-     // true = packet is in "error" and failes
-     // false = packet not in error and sends
-     if (iter->second.linkState)
+  }
+  else
+  {
+      NS_LOG_DEBUG(std::setprecision (9) << currTime.GetSeconds() << " State " << link.linkState << " for link src: " << srcId << " dst: " << dstId 
+                 << " expireTime: " << std::setprecision (9) << link.stateExpireTime.GetSeconds());
+  }
+  
+  // now return true or false depending on state
+  // true = packet is in "error" and failes
+  // false = packet not in error and sends
+  if (link.linkState)
+  {
+     return false;
+  } 
+  else
+  {
+     return true;
+  }
+}
+
+//********************************************************************
+// Stochastic link storage
+
+const uint64_t StochasticLinkTable::NO_LINK;
+
+StochasticLinkTable::StochasticLinkTable ()
+  : m_storage (STOCHASTIC_STORAGE_DENSE),
+    m_nLinks (0),
+    m_denseSize (0),
+    m_denseUsed (0)
+{
+}
+
+void StochasticLinkTable::SetStorage (StochasticStorageType storage)
+{
+  Clear ();
+  m_storage = storage;
+}
+
+void StochasticLinkTable::Clear (void)
+{
+  m_nLinks = 0;
+  m_denseIndex.clear ();
+  m_denseSize = 0;
+  m_denseUsed = 0;
+  m_dense.clear ();
+  m_hashKeys.clear ();
+  m_hashValues.clear ();
+}
+
+void StochasticLinkTable::AddNodes (const std::vector<uint32_t> &nodeIds)
+{
+  if (m_storage == STOCHASTIC_STORAGE_DENSE)
+  {
+     uint32_t size = m_denseUsed + nodeIds.size ();
+     if (size > m_denseSize)
      {
-        return false;
-     } 
-     else
+        ResizeDense (size);
+     }
+     for (std::vector<uint32_t>::const_iterator it = nodeIds.begin (); it != nodeIds.end (); ++it)
      {
-        return true;
-     } 
+        GetDenseIndex (*it);
+     }
   }
   else
   {
-     return false;
+     // Room for links between all the nodes at half load
+     uint64_t links = static_cast<uint64_t> (nodeIds.size ()) * nodeIds.size ();
+     uint32_t capacity = 16;
+     while ( (capacity < 0x80000000u) && (capacity < 2 * links) )
+     {
+        capacity *= 2;
+     }
+     if (capacity > m_hashKeys.size ())
+     {
+        ResizeHash (capacity);
+     }
+  }
+}
+
+uint64_t *StochasticLinkTable::Find (uint32_t srcId, uint32_t dstId)
+{
+  if (m_storage == STOCHASTIC_STORAGE_DENSE)
+  {
+     if ( (srcId >= m_denseIndex.size ()) || (dstId >= m_denseIndex.size ())
+          || (m_denseIndex[srcId] < 0) || (m_denseIndex[dstId] < 0) )
+     {
+        return 0;
+     }
+     uint64_t *link = &m_dense[static_cast<uint64_t> (m_denseIndex[srcId]) * m_denseSize + m_denseIndex[dstId]];
+     return (*link == NO_LINK) ? 0 : link;
+  }
+  
+  if (m_hashKeys.empty ())
+  {
+     return 0;
+  }
+  uint64_t key = (static_cast<uint64_t> (srcId) << 32) | dstId;
+  uint32_t mask = m_hashKeys.size () - 1;
+  for (uint32_t i = Hash (key, mask); ; i = (i + 1) & mask)
+  {
+     if (m_hashKeys[i] == key)
+     {
+        return &m_hashValues[i];
+     }
+     if (m_hashKeys[i] == NO_LINK)
+     {
+        return 0;
+     }
+  }
+}
+
+uint64_t *StochasticLinkTable::Insert (uint32_t srcId, uint32_t dstId)
+{
+  if (m_storage == STOCHASTIC_STORAGE_DENSE)
+  {
+     uint64_t index = static_cast<uint64_t> (GetDenseIndex (srcId)) * m_denseSize;
+     index += GetDenseIndex (dstId);
+     if (m_dense[index] == NO_LINK)
+     {
+        m_nLinks++;
+     }
+     return &m_dense[index];
+  }
+  
+  // keep the load at or below one half
+  if (2 * (m_nLinks + 1) > m_hashKeys.size ())
+  {
+     ResizeHash (m_hashKeys.empty () ? 16 : 2 * m_hashKeys.size ());
+  }
+  uint64_t key = (static_cast<uint64_t> (srcId) << 32) | dstId;
+  uint32_t mask = m_hashKeys.size () - 1;
+  uint32_t i = Hash (key, mask);
+  while ( (m_hashKeys[i] != key) && (m_hashKeys[i] != NO_LINK) )
+  {
+     i = (i + 1) & mask;
+  }
+  if (m_hashKeys[i] == NO_LINK)
+  {
+     m_hashKeys[i] = key;
+     m_hashValues[i] = NO_LINK;
+     m_nLinks++;
+  }
+  return &m_hashValues[i];
+}
+
+uint32_t StochasticLinkTable::GetNLinks (void) const
+{
+  return m_nLinks;
+}
+
+uint64_t StochasticLinkTable::Pack (const StochasticLink &link)
+{
+  return (static_cast<uint64_t> (link.stateExpireTime.GetNanoSeconds ()) << 1) | (link.linkState ? 1 : 0);
+}
+
+StochasticLink StochasticLinkTable::Unpack (uint64_t value)
+{
+  StochasticLink link;
+  link.linkState = (value & 1) != 0;
+  link.stateExpireTime = NanoSeconds (static_cast<int64_t> (value >> 1));
+  return link;
+}
+
+uint32_t StochasticLinkTable::GetDenseIndex (uint32_t nodeId)
+{
+  if (nodeId >= m_denseIndex.size ())
+  {
+     m_denseIndex.resize (nodeId + 1, -1);
+  }
+  if (m_denseIndex[nodeId] < 0)
+  {
+     if (m_denseUsed == m_denseSize)
+     {
+        ResizeDense (m_denseSize == 0 ? 16 : 2 * m_denseSize);
+     }
+     m_denseIndex[nodeId] = m_denseUsed++;
+  }
+  return m_denseIndex[nodeId];
+}
+
+void StochasticLinkTable::ResizeDense (uint32_t size)
+{
+  std::vector<uint64_t> dense (static_cast<uint64_t> (size) * size, NO_LINK);
+  for (uint32_t row = 0; row < m_denseUsed; ++row)
+  {
+     std::copy (m_dense.begin () + static_cast<uint64_t> (row) * m_denseSize,
+                m_dense.begin () + static_cast<uint64_t> (row) * m_denseSize + m_denseUsed,
+                dense.begin () + static_cast<uint64_t> (row) * size);
+  }
+  m_dense.swap (dense);
+  m_denseSize = size;
+}
+
+void StochasticLinkTable::ResizeHash (uint32_t capacity)
+{
+  std::vector<uint64_t> keys (capacity, NO_LINK);
+  std::vector<uint64_t> values (capacity, NO_LINK);
+  uint32_t mask = capacity - 1;
+  for (uint32_t j = 0; j < m_hashKeys.size (); ++j)
+  {
+     if (m_hashKeys[j] != NO_LINK)
+     {
+        uint32_t i = Hash (m_hashKeys[j], mask);
+        while (keys[i] != NO_LINK)
+        {
+           i = (i + 1) & mask;
+        }
+        keys[i] = m_hashKeys[j];
+        values[i] = m_hashValues[j];
+     }
   }
+  m_hashKeys.swap (keys);
+  m_hashValues.swap (values);
+}
+
+uint32_t StochasticLinkTable::Hash (uint64_t key, uint32_t mask)
+{
+  // Fibonacci hashing, the upper bits are the best mixed
+  return static_cast<uint32_t> ((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
 }
 
 //********************************************************************
 
+// Uses the shared random stream since there is no link to key a
+// per link stream with
 bool SimpleWirelessChannel::packetInError(double distance)
 {
-  std::map<double, double>::iterator it;
-  std::map<double, double>::iterator up_iter;
-  std::map<double, double>::iterator low_iter;
-  
+  return DrawPacketError (GetPacketErrorRate (distance), distance, 0, 0, false);
+}
+
+// Get the error rate for a packet sent over the given distance. This is
+// the value a random draw is compared to or one of the special values
+// for packets that are never or always in error without a draw.
+double SimpleWirelessChannel::GetPacketErrorRate(double distance)
+{
   if (m_ErrorModel == CONSTANT)
   {
-      if ( m_random->GetValue () < m_errorRate )
-      {
-        NS_LOG_INFO("Error Model: " << m_ErrorModel << " Checking for error at distance: " << distance << "  Too high error. Packet in error.");
-        return true;
-      }
+      return m_errorRate;
   }
   else if (m_ErrorModel == PER_CURVE)
   {
-     it = mPERmap.find(distance);
-     if (it != mPERmap.end())
+     return LookupPERCurve (distance);
+  }
+
+  // no per packet errors with the stochastic model
+  return NEVER_IN_ERROR;
+}
+
+// Get the error rates for a set of distances at once
+void SimpleWirelessChannel::GetPacketErrorRates(const std::vector<double> &distances, std::vector<double> &errorRates)
+{
+  errorRates.resize (distances.size ());
+  if (m_ErrorModel == PER_CURVE)
+  {
+     if (m_perTableDirty || (m_perBuiltResolution != m_perResolution))
      {
-       // we found an exact match in the map for this distance
-       if (m_random->GetValue() < it->second)
-       {
-          NS_LOG_INFO("Error Model: " << m_ErrorModel << " Checking for error at distance: " << distance << "  Too high error. Packet in error.");
-          return true;
-       }
+        BuildPERTable ();
      }
-     else
+     for (uint32_t i = 0; i < distances.size (); ++i)
      {
-       // we did not find an exact match in the map. That's OK
-       // since it could actually be unlikely to find one.
-       // Now we just extrapolate between the two entries in the map
-       
-       // first get iterator to upper bound
-       up_iter = mPERmap.upper_bound(distance);
-       if (up_iter == mPERmap.end())
-       {
-         // We shouldn't hit this situation because we already checked the distance
-         // relative to the range but go ahead and leave this here
-         // this distance is beyond the upper bound so error is 100%
-         NS_LOG_INFO("Error Model: " << m_ErrorModel << " Checking for error at distance: " << distance << "  Too high error. Packet in error.");
-         return true;
-       }
-       
-       // Set low iter to upper then decrement it
-       low_iter = up_iter;
-       --low_iter;
-       
-       double errorRate = low_iter->second + ( ((distance - low_iter->first)/(up_iter->first - low_iter->first)) * (up_iter->second - low_iter->second));
-       NS_LOG_INFO("Error Model: " << m_ErrorModel << "  distance: " << distance << "  calculated error rate: " << errorRate << "  low distance: " << low_iter->first << "  low error: " << low_iter->second 
-                    << "  high distance: " << up_iter->first << "  high error: " << up_iter->second);
-       
-       if (m_random->GetValue() < errorRate)
-       {
-          return true;
-       }
-     }
-  }
-
-
-  // if we get here then there were no errors
-  return false;
+        errorRates[i] = LookupPERCurve (distances[i]);
+     }
+  }
+  else
+  {
+     double errorRate = (m_ErrorModel == CONSTANT) ? m_errorRate : NEVER_IN_ERROR;
+     std::fill (errorRates.begin (), errorRates.end (), errorRate);
+  }
+}
+
+// Build the flat copy of the PER curve and the table that maps a distance
+// to the first point on the curve past it. The table has one entry per
+// PerTableResolution meters so a lookup only has to step over the curve
+// points inside one entry.
+void SimpleWirelessChannel::BuildPERTable (void)
+{
+  m_perDistance.clear ();
+  m_perError.clear ();
+  for (std::map<double, double>::const_iterator it = mPERmap.begin (); it != mPERmap.end (); ++it)
+  {
+     m_perDistance.push_back (it->first);
+     m_perError.push_back (it->second);
+  }
+  
+  m_perTable.clear ();
+  m_perBuiltResolution = m_perResolution;
+  m_perTableResolution = m_perResolution;
+  m_perTableDirty = false;
+  if (m_perDistance.size () < 2)
+  {
+     return;
+  }
+  
+  // Limit the size of the table for very small resolutions
+  double span = m_perDistance.back () - m_perDistance.front ();
+  double entries = std::ceil (span / m_perTableResolution) + 1;
+  if ( (m_perTableResolution <= 0) || (entries > MAX_PER_TABLE_SIZE) )
+  {
+     m_perTableResolution = span / (MAX_PER_TABLE_SIZE - 1);
+     entries = MAX_PER_TABLE_SIZE;
+  }
+  
+  m_perTable.resize (static_cast<uint32_t> (entries));
+  for (uint32_t i = 0; i < m_perTable.size (); ++i)
+  {
+     double start = m_perDistance.front () + i * m_perTableResolution;
+     m_perTable[i] = std::upper_bound (m_perDistance.begin (), m_perDistance.end (), start) - m_perDistance.begin ();
+  }
+  NS_LOG_DEBUG ("Built PER table with " << m_perTable.size () << " entries for " << m_perDistance.size () 
+                << " curve points. resolution: " << m_perTableResolution);
+}
+
+double SimpleWirelessChannel::LookupPERCurve (double distance)
+{
+  if (m_perTableDirty || (m_perBuiltResolution != m_perResolution))
+  {
+     BuildPERTable ();
+  }
+  
+  uint32_t up;
+  double errorRate = FindPERCurve (distance, up);
+  if ( (up > 0) && (up < m_perDistance.size ()) && (m_perDistance[up - 1] != distance) )
+  {
+     uint32_t low = up - 1;
+     NS_LOG_INFO("Error Model: " << m_ErrorModel << "  distance: " << distance << "  calculated error rate: " << errorRate << "  low distance: " << m_perDistance[low] << "  low error: " << m_perError[low] 
+                  << "  high distance: " << m_perDistance[up] << "  high error: " << m_perError[up]);
+  }
+  return errorRate;
+}
+
+// Get the error rate from the PER table, which must be up to date. Also
+// returns the index of the first point on the curve past the distance.
+// This does not change the channel so it can be called from the
+// receiver threads.
+double SimpleWirelessChannel::FindPERCurve (double distance, uint32_t &up) const
+{
+  // Find the first point on the curve past this distance
+  uint32_t n = m_perDistance.size ();
+  up = 0;
+  if (!m_perTable.empty () && (distance >= m_perDistance.front ()))
+  {
+     uint32_t entry = static_cast<uint32_t> ((distance - m_perDistance.front ()) / m_perTableResolution);
+     if (entry >= m_perTable.size ())
+     {
+        entry = m_perTable.size () - 1;
+     }
+     up = m_perTable[entry];
+  }
+  
+  // The table entry is only a starting point. Step to the exact
+  // point, which also covers rounding in the entry computation.
+  while ( (up > 0) && (m_perDistance[up - 1] > distance) )
+  {
+     --up;
+  }
+  while ( (up < n) && (m_perDistance[up] <= distance) )
+  {
+     ++up;
+  }
+  
+  if ( (up > 0) && (m_perDistance[up - 1] == distance) )
+  {
+     // we found an exact match on the curve for this distance
+     return m_perError[up - 1];
+  }
+  
+  if (up == n)
+  {
+     // We shouldn't hit this situation because we already checked the distance
+     // relative to the range but go ahead and leave this here
+     // this distance is beyond the upper bound so error is 100%
+     return ALWAYS_IN_ERROR;
+  }
+  
+  if (up == 0)
+  {
+     // closer than the first point on the curve
+     return m_perError[0];
+  }
+  
+  // Interpolate between the two points on either side of the distance
+  uint32_t low = up - 1;
+  return m_perError[low] + ( ((distance - m_perDistance[low])/(m_perDistance[up] - m_perDistance[low])) * (m_perError[up] - m_perError[low]));
+}
+
+// Decide if a packet is in error given the error rate from GetPacketErrorRate.
+// The random value comes from the link's own stream if PerLinkErrorStreams
+// is set and from the shared stream otherwise.
+bool SimpleWirelessChannel::DrawPacketError(double errorRate, double distance, uint32_t srcId, uint32_t dstId, bool perLink)
+{
+  if (errorRate == NEVER_IN_ERROR)
+  {
+     return false;
+  }
+  
+  if (errorRate != ALWAYS_IN_ERROR)
+  {
+     double value = (perLink && m_perLinkErrorStreams) ? GetLinkUniform (srcId, dstId) : GetUniform ();
+     if (value >= errorRate)
+     {
+        // if we get here then there were no errors
+        return false;
+     }
+  }
+  
+  NS_LOG_INFO("Error Model: " << m_ErrorModel << " Checking for error at distance: " << distance << "  Too high error. Packet in error.");
+  return true;
+}
+
+// Get the next value of the shared stream. This is the value a
+// UniformRandomVariable on the same stream would return, without the
+// virtual call and the range scaling.
+double SimpleWirelessChannel::GetUniform(void)
+{
+  return m_random.RandU01 ();
+}
+
+int64_t SimpleWirelessChannel::AssignStreams(int64_t stream)
+{
+  NS_LOG_FUNCTION (this << stream);
+  m_streamBase = stream;
+  // Same stream as UniformRandomVariable::SetStream (stream) gives
+  m_random = RngStream (RngSeedManager::GetSeed (), (static_cast<uint64_t> (1) << 63) + stream, RngSeedManager::GetRun ());
+  m_linkKeyValid = false;
+  
+  if (m_randomUp != 0)
+  {
+     m_randomUp->SetStream (stream + 1);
+     m_randomDown->SetStream (stream + 2);
+  }
+  if (m_randomState != 0)
+  {
+     m_randomState->SetStream (stream + 3);
+  }
+  return 4;
+}
+
+// Philox4x32-10 counter based generator (Salmon et al., "Parallel Random
+// Numbers: As Easy as 1, 2, 3", SC 2011). The counter is replaced by the
+// 128 random bits for the given key.
+static void
+Philox4x32 (uint32_t counter[4], uint32_t key0, uint32_t key1)
+{
+  for (int round = 0; round < 10; ++round)
+  {
+     uint64_t product0 = static_cast<uint64_t> (0xD2511F53) * counter[0];
+     uint64_t product1 = static_cast<uint64_t> (0xCD9E8D57) * counter[2];
+     uint32_t next0 = static_cast<uint32_t> (product1 >> 32) ^ counter[1] ^ key0;
+     uint32_t next2 = static_cast<uint32_t> (product0 >> 32) ^ counter[3] ^ key1;
+     counter[0] = next0;
+     counter[1] = static_cast<uint32_t> (product1);
+     counter[2] = next2;
+     counter[3] = static_cast<uint32_t> (product0);
+     key0 += 0x9E3779B9;
+     key1 += 0xBB67AE85;
+  }
+}
+
+// Derive the key of this channel from the seed and run by encrypting
+// the assigned stream, or the channel id when no stream was assigned.
+// Channels that share nodes then draw different values for the same
+// link.
+void SimpleWirelessChannel::UpdateLinkKey(void)
+{
+  uint64_t run = RngSeedManager::GetRun ();
+  uint64_t channel = (m_streamBase >= 0) ? static_cast<uint64_t> (m_streamBase) : GetId ();
+  uint32_t counter[4];
+  counter[0] = static_cast<uint32_t> (channel);
+  counter[1] = static_cast<uint32_t> (channel >> 32);
+  counter[2] = (m_streamBase >= 0) ? 1 : 0;
+  counter[3] = 0;
+  Philox4x32 (counter, RngSeedManager::GetSeed (), static_cast<uint32_t> (run ^ (run >> 32)));
+  m_linkKey[0] = counter[0];
+  m_linkKey[1] = counter[1];
+  m_linkKeyValid = true;
+}
+
+// Get the next uniform value in [0, 1) for the link. The value only
+// depends on the key of the channel, the two nodes and how many values
+// the link has used before, so it does not matter in what order links
+// are checked.
+double SimpleWirelessChannel::GetLinkUniform(uint32_t srcId, uint32_t dstId)
+{
+  if (!m_linkKeyValid)
+  {
+     UpdateLinkKey ();
+  }
+  
+  uint64_t *sequence = m_linkSequences.Find (srcId, dstId);
+  if (sequence == 0)
+  {
+     sequence = m_linkSequences.Insert (srcId, dstId);
+     *sequence = 0;
+  }
+  
+  uint32_t counter[4];
+  counter[0] = srcId;
+  counter[1] = dstId;
+  counter[2] = static_cast<uint32_t> (*sequence);
+  counter[3] = static_cast<uint32_t> (*sequence >> 32);
+  Philox4x32 (counter, m_linkKey[0], m_linkKey[1]);
+  (*sequence)++;
+  
+  // 53 random bits for the mantissa
+  uint64_t bits = (static_cast<uint64_t> (counter[0]) << 32) | counter[1];
+  return (bits >> 11) * (1.0 / 9007199254740992.0);
 }
 
 
@@ -21,11 +21,19 @@
 #define SIMPLE_WIRELESS_CHANNEL_H
 
 #include <vector>
+#include <map>
+#include <set>
 #include "ns3/channel.h"
 #include "ns3/mac48-address.h"
 #include "ns3/random-variable-stream.h"
+#include "ns3/rng-stream.h"
 #include "ns3/enum.h"
 #include "ns3/string.h"
+#include "ns3/mobility-model.h"
+#include "ns3/nstime.h"
+#include "ns3/packet.h"
+#include "ns3/event-id.h"
+#include "channel-thread-pool.h"
 
 
 
@@ -55,32 +63,63 @@ enum ErrorModelType {
     STOCHASTIC
 };
 
-//***************************************************************
-// Define key for stochastic error map key
-//***************************************************************
-class StochasticKey {
-   public:
-   int srcNodeId;
-   int destNodeId;
- 
-   StochasticKey(int k1, int k2)
-      : srcNodeId(k1), destNodeId(k2){}  
-      
-   // Ordering is:
-   //   1. lowest source node id
-   //   2. lowest destination node id
-
-   bool operator<(const StochasticKey &right) const   
-   {
-      if (srcNodeId == right.srcNodeId) 
-      {
-         return(destNodeId < right.destNodeId);
-      }
-      else 
-      {
-         return (srcNodeId < right.srcNodeId);
-      }
-   }    
+enum SpatialIndexType {
+    /**
+     * No spatial index. Every device on the channel is checked
+     * for every packet sent.
+     */
+    SPATIAL_INDEX_NONE,
+    /**
+     * Devices are binned into a uniform grid with cells the size
+     * of the larger of the transmission range and the fixed contention
+     * range. Only devices in the sender's cell and the eight cells
+     * around it are checked. Devices that are moving (non-zero velocity)
+     * are not binned and are always checked.
+     */
+    SPATIAL_INDEX_GRID,
+    /**
+     * Each sender keeps a list of the devices within the range plus
+     * VerletSkin of it. The list is rebuilt when two devices moving
+     * toward each other at MaxNodeSpeed could have crossed the skin
+     * since it was built. A device that moves faster than MaxNodeSpeed
+     * (for example SetPosition) causes all lists to be rebuilt.
+     */
+    SPATIAL_INDEX_VERLET,
+    /**
+     * Devices are kept in an octree over their 3D positions. Each
+     * node is split until it holds a few devices, so clustered and
+     * sparse areas both give short candidate lists. Only devices in
+     * nodes within the sender's range are checked. The tree is rebuilt
+     * when devices are added, change course, or moving devices are read.
+     */
+    SPATIAL_INDEX_OCTREE
+};
+
+// x and y index of a cell in the spatial index grid
+typedef std::pair<int32_t, int32_t> GridCell;
+
+// A node of the octree spatial index. The node's devices are the slots
+// m_octreeSlots [begin, end). A child of zero means the octant is empty.
+struct OctreeNode {
+    double lo[3];        // bounds of the node's devices (meters)
+    double hi[3];
+    uint32_t begin;
+    uint32_t end;
+    uint32_t child[8];
+    bool leaf;
+};
+
+enum StochasticStorageType {
+    /**
+     * Links are stored in a matrix with a row and column for each
+     * node on the channel. Lookups are a single index.
+     */
+    STOCHASTIC_STORAGE_DENSE,
+    /**
+     * Links are stored in an open addressing hash table. Uses less
+     * memory than the matrix when only some of the links exist.
+     */
+    STOCHASTIC_STORAGE_HASHED
 };
 
 struct StochasticLink
@@ -89,7 +128,123 @@ struct StochasticLink
    Time  stateExpireTime;
 };
 
-typedef std::map<StochasticKey, StochasticLink> ::iterator  StochasIt;
+//***************************************************************
+// Storage for the state of the stochastic links. Each link is
+// packed into 64 bits with the time the state expires (in
+// nanoseconds) in the upper 63 bits and the state in the low bit.
+//***************************************************************
+class StochasticLinkTable
+{
+public:
+  StochasticLinkTable ();
+  
+  void SetStorage (StochasticStorageType storage);
+  void Clear (void);
+  
+  // Make room for links between the given nodes. Only needed for
+  // dense storage but avoids growing the table one node at a time.
+  void AddNodes (const std::vector<uint32_t> &nodeIds);
+  
+  // Returns the link or 0 if there is no link for this pair
+  uint64_t *Find (uint32_t srcId, uint32_t dstId);
+  
+  // Returns the link, creating it set to NO_LINK if needed
+  uint64_t *Insert (uint32_t srcId, uint32_t dstId);
+  
+  uint32_t GetNLinks (void) const;
+  
+  static uint64_t Pack (const StochasticLink &link);
+  static StochasticLink Unpack (uint64_t value);
+  
+  static const uint64_t NO_LINK = ~static_cast<uint64_t> (0);
+
+private:
+  uint32_t GetDenseIndex (uint32_t nodeId);
+  void ResizeDense (uint32_t size);
+  void ResizeHash (uint32_t capacity);
+  static uint32_t Hash (uint64_t key, uint32_t mask);
+  
+  StochasticStorageType m_storage;
+  uint32_t m_nLinks;
+  
+  // dense storage. m_denseIndex maps node id to row/column, -1 if none
+  std::vector<int32_t> m_denseIndex;
+  uint32_t m_denseSize;
+  uint32_t m_denseUsed;
+  std::vector<uint64_t> m_dense;
+  
+  // hashed storage with linear probing. Key is source id in the upper
+  // 32 bits and destination id in the lower 32 bits.
+  std::vector<uint64_t> m_hashKeys;
+  std::vector<uint64_t> m_hashValues;
+};
+
+// Precomputed receiver used by the static topology mode
+struct StaticReceiver
+{
+   uint32_t slot;          // position of the receiving device in the channel
+   double   distance;      // meters
+   double   propDelay;     // nanoseconds
+   double   errorRate;     // error rate from the error model
+   bool     inContention;  // within the fixed contention range
+   bool     inRange;       // within the transmission range
+};
+
+class SimpleWirelessChannel;
+
+//***************************************************************
+// Error model policies for the channel's send loop. The loop is a
+// template over the policy so it only makes the checks the error
+// model needs. A policy has two static functions:
+//   LinkDown: true if the link from srcId to dstId is down
+//   InError:  true if a packet sent over distance from srcId to
+//             dstId is in error
+// To add an error model, add a policy and a case for it in
+// SimpleWirelessChannel::Send.
+//***************************************************************
+struct ConstantErrorPolicy
+{
+   static bool LinkDown (SimpleWirelessChannel &channel, uint32_t srcId, uint32_t dstId);
+   static bool InError (SimpleWirelessChannel &channel, double distance, uint32_t srcId, uint32_t dstId);
+};
+
+struct PerCurveErrorPolicy
+{
+   static bool LinkDown (SimpleWirelessChannel &channel, uint32_t srcId, uint32_t dstId);
+   static bool InError (SimpleWirelessChannel &channel, double distance, uint32_t srcId, uint32_t dstId);
+};
+
+struct StochasticErrorPolicy
+{
+   static bool LinkDown (SimpleWirelessChannel &channel, uint32_t srcId, uint32_t dstId);
+   static bool InError (SimpleWirelessChannel &channel, double distance, uint32_t srcId, uint32_t dstId);
+};
+
+// A receiver of a batched delivery or a dropped reception and the
+// time from the transmission to its arrival. A dropped reception
+// only fires the receiver's drop traces.
+struct PendingDelivery
+{
+   Time      arrival;
+   uint32_t  slot;
+   bool      dropped;
+   
+   bool operator< (const PendingDelivery &other) const
+   {
+      return arrival < other.arrival;
+   }
+};
+
+// The recorded receivers of one transmission, sorted by arrival
+struct DeliveryBatch : public SimpleRefCount<DeliveryBatch>
+{
+   Ptr<const Packet> packet;
+   uint16_t      protocol;
+   Mac48Address  to;
+   Mac48Address  from;
+   std::vector<PendingDelivery> receivers;
+   uint32_t      next;    // first receiver not yet delivered
+};
 
 /**
  * \ingroup channel
@@ -97,6 +252,10 @@ typedef std::map<StochasticKey, StochasticLink> ::iterator  StochasIt;
  */
 class SimpleWirelessChannel : public Channel
 {
+  friend struct ConstantErrorPolicy;
+  friend struct PerCurveErrorPolicy;
+  friend struct StochasticErrorPolicy;
+  
 public:
   static TypeId GetTypeId (void);
   SimpleWirelessChannel ();
@@ -114,28 +273,322 @@ public:
   void setErrorRate(double error);
   void addToPERmodel(double distance, double error);
   bool packetInError(double distance);
+  void GetPacketErrorRates(const std::vector<double> &distances, std::vector<double> &errorRates);
   void EnableFixedContention(void);
   void SetFixedContentionRange(double error);
+  
+  /**
+   * Bring the fixed contention neighbor counts of the devices up to date.
+   * Only does anything when ContentionUpdateInterval is not zero.
+   */
+  void UpdateContention(void);
   void InitStochasticModel();
   bool CheckStochasticError(uint32_t srcId, uint32_t dstId);
   
+  /**
+   * Called by a device on the channel when its address or its need to see
+   * frames for other hosts changes.
+   */
+  void DeviceChanged (void);
+  
+  /**
+   * \returns true if the receive error models of the devices are checked
+   * by the channel when the packet is sent
+   */
+  bool GetEarlyReceiveDrop (void) const;
+  
+  /**
+   * Get the look ahead for distributed simulation, which is the shortest
+   * time from the start of a transmission to its arrival on another
+   * system: the tx time of a LookAheadPacketSize packet at the highest data
+   * rate. The propagation delay is left out since nodes may move closer
+   * to nodes of other systems at any time.
+   *
+   * The look ahead is not applied by the channel. The distributed
+   * simulator only takes its look ahead from point to point remote
+   * channels, so the script must add one with this delay or less.
+   *
+   * \returns the look ahead, or Time::Max () if all nodes are on one system
+   */
+  Time GetLookAhead (void);
+  
+  /**
+   * Assign fixed random variable stream numbers to the random variables
+   * used by this channel. Return the number of streams (possibly zero)
+   * that have been assigned.
+   *
+   * \param stream first stream index to use
+   * \return the number of stream indices assigned by this channel
+   */
+  int64_t AssignStreams (int64_t stream);
+  
+  /**
+   * Pick the system (MPI rank) for a node by splitting the area from minX
+   * to maxX into nSystems strips. Nodes must be created with their system
+   * id so this is meant to be called before the nodes are created.
+   *
+   * \returns the system id for a node at the given position
+   */
+  static uint32_t GetGeographicSystemId (const Vector &position, double minX, double maxX, uint32_t nSystems);
+  
+protected:
+  virtual void DoDispose (void);
+
 private:
+  template <class ErrorPolicy>
+  void SendWithPolicy (Ptr<const Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from,
+                       Ptr<SimpleWirelessNetDevice> sender, Time txTime, uint32_t destId,
+                       bool indexed, uint32_t count, double limitSquared, bool contention,
+                       const double *errorRates);
+  template <class ErrorPolicy, bool Contention, bool Directional>
+  void SendToDevices (Ptr<const Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from,
+                      Ptr<SimpleWirelessNetDevice> sender, Time txTime, uint32_t destId,
+                      bool indexed, uint32_t count, double limitSquared,
+                      const double *errorRates);
+  void ScheduleReceive (Ptr<const Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from,
+                        uint32_t slot, Time delay);
+  void SendRemote (Ptr<const Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from,
+                   uint32_t slot, Time delay);
+  void FlushDeliveries (Ptr<const Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from);
+  void DeliverBatch (Ptr<DeliveryBatch> batch);
+  void DeliverDrops (Ptr<DeliveryBatch> batch);
+
+  //******************************************
+  // Position snapshot functions
+  void UpdatePositionSnapshot (void);
+  void ReadPosition (uint32_t slot);
+  void ComputeDistancesSquared (const Vector &position);
+  void ComputeDistancesSquared (const Vector &position, const std::vector<uint32_t> &slots);
+  void CourseChanged (Ptr<const MobilityModel> model);
+  void UpdateContentionSlot (uint32_t slot);
+
+  //******************************************
+  // Receiver thread functions
+  void EvaluateReceiversParallel (const Vector &position, bool indexed, uint32_t count, double limitSquared);
+  void EvaluateReceivers (uint32_t begin, uint32_t end);
+
+  //******************************************
+  // Static topology functions
+  bool PrepareStaticTopology (void);
+  void BuildStaticReceivers (uint32_t senderSlot);
+  void SendStatic (Ptr<const Packet> p, uint16_t protocol, Mac48Address to, Mac48Address from,
+                   Ptr<SimpleWirelessNetDevice> sender, Time txTime, uint32_t destId);
+
+  //******************************************
+  // Direct unicast functions
+  bool PrepareDirectUnicast (Mac48Address to);
+  bool IsDirectReceiver (uint32_t slot, Mac48Address to) const;
+  void GetDirectReceivers (Mac48Address to, std::vector<uint32_t> &slots);
+
+  //******************************************
+  // Stochastic error functions
+  void InitStochasticRandom (void);
+  uint64_t *CreateStochasticLink (uint32_t srcId, uint32_t dstId);
+  bool SampleStochasticState (bool startState, double elapsed);
+  double GetStateUniform (void);
+  bool StochasticLinkDown (uint32_t srcId, uint32_t dstId);
+
+  //******************************************
+  // Error model functions
+  double GetPacketErrorRate (double distance);
+  void BuildPERTable (void);
+  double LookupPERCurve (double distance);
+  double FindPERCurve (double distance, uint32_t &up) const;
+  bool DrawPacketError (double errorRate, double distance, uint32_t srcId, uint32_t dstId, bool perLink = true);
+  double GetLinkUniform (uint32_t srcId, uint32_t dstId);
+  void UpdateLinkKey (void);
+  double GetUniform (void);
+
+  //******************************************
+  // Spatial index functions
+  bool PrepareSpatialIndex (void);
+  void RebuildSpatialIndex (double cellSize);
+  void IndexDevice (uint32_t slot);
+  void UnindexDevice (uint32_t slot);
+  GridCell GetGridCell (double x, double y) const;
+  void GetCandidateDevices (const Vector &position, std::vector<uint32_t> &candidates);
+  void GetNodeDevices (uint32_t nodeId, std::vector<uint32_t> &candidates) const;
+
+  //******************************************
+  // Transmission range functions
+  double GetTxRange (Ptr<SimpleWirelessNetDevice> device) const;
+  double GetLargestTxRange (void);
+
+  //******************************************
+  // Octree functions
+  bool PrepareOctree (void);
+  void RebuildOctree (void);
+  void UpdateOctreeDrift (uint32_t slot);
+  uint32_t BuildOctreeNode (uint32_t begin, uint32_t end, uint32_t depth);
+  void GetOctreeCandidates (const Vector &position, double limit, std::vector<uint32_t> &candidates);
+
+  //******************************************
+  // Neighbor list functions
+  bool PrepareVerletLists (void);
+  void GetVerletCandidates (Ptr<SimpleWirelessNetDevice> sender, double limit, std::vector<uint32_t> &candidates);
+
   std::vector<Ptr<SimpleWirelessNetDevice> > m_devices;
+  std::map<const SimpleWirelessNetDevice *, uint32_t> m_deviceSlots;
   double m_range;
   double m_errorRate;
   ErrorModelType m_ErrorModel;
-  Ptr<UniformRandomVariable> m_random;
+  // Shared stream for packet errors. The channel reads the RngStream
+  // directly instead of through a UniformRandomVariable.
+  RngStream m_random;
+  int64_t m_streamBase;               // first assigned stream, -1 if not assigned
   std::map<double, double>  mPERmap;
   
+  // Flat copy of the PER curve and a table with one entry per
+  // m_perTableResolution meters giving the first curve point past
+  // the start of the entry.
+  double m_perResolution;
+  double m_perTableResolution;
+  double m_perBuiltResolution;   // value of m_perResolution the table was built for
+  bool   m_perTableDirty;
+  std::vector<double> m_perDistance;
+  std::vector<double> m_perError;
+  std::vector<uint32_t> m_perTable;
+  
+  // Counter based error streams. Number of values each link has used
+  // and the key of this channel, derived from the seed, the run and the
+  // assigned stream (or the channel id).
+  bool   m_perLinkErrorStreams;
+  StochasticLinkTable m_linkSequences;
+  bool     m_linkKeyValid;
+  uint32_t m_linkKey[2];
+  
   bool   m_fixedContentionEnabled;
   double m_fixedContentionRange;
+  
+  // Neighbor counts kept by the channel. Recomputed when devices are
+  // added or when m_contentionInterval has passed. A course change only
+  // updates the counts the moved device takes part in.
+  Time   m_contentionInterval;
+  bool   m_contentionDirty;
+  Time   m_contentionTime;
+  double m_contentionRange;    // contention range the counts were computed with
+  std::vector<double> m_contentionX;   // positions the counts were computed with
+  std::vector<double> m_contentionY;
+  std::vector<double> m_contentionZ;
+  std::vector<int> m_contentionCounts;
   Ptr<ExponentialRandomVariable> m_randomUp;
   Ptr<ExponentialRandomVariable> m_randomDown;
+  Ptr<UniformRandomVariable> m_randomState;
   
   Time m_upDuration;
   Time m_downDuration;
-  std::map<StochasticKey, StochasticLink>   m_StochasticLinks;
+  StochasticStorageType m_stochasticStorage;
+  bool                  m_stochasticLazy;
+  bool                  m_stochasticDirectCatchUp;
+  StochasticLinkTable   m_StochasticLinks;
+  
+  // Position snapshot. This is a structure of arrays holding the position
+  // and node id of every device, indexed by the position (slot) of the
+  // device in m_devices. Devices that are not moving are updated on a
+  // course change and moving devices are read again when time advances.
+  bool m_snapshotDirty;    // devices were added, rebuild before next send
+  Time m_snapshotTime;
+  Time m_positionRefreshInterval;    // minimum time between reads of moving devices
+  std::vector<Ptr<MobilityModel> > m_mobility;
+  std::vector<double> m_posX;
+  std::vector<double> m_posY;
+  std::vector<double> m_posZ;
+  std::vector<Time> m_posTime;       // time the position was read
+  std::vector<uint32_t> m_nodeIds;
+  std::vector<uint32_t> m_systemIds;
+  std::vector<bool> m_deviceMoving;
+  std::set<uint32_t> m_movingDevices;
+  std::set<uint32_t> m_fastDevices;   // moving faster than m_maxNodeSpeed
+  std::map<const MobilityModel *, std::vector<uint32_t> > m_mobilitySlots;
+  std::vector<double> m_distSq;
+  
+  // Distributed simulation. Packets to devices on nodes whose system id
+  // is not the local one are sent through MPI.
+  bool     m_distributed;
+  uint32_t m_localSystemId;
+  uint32_t m_lookAheadPacketSize;
+  
+  // Receiver threads. The position and limit of the current send are
+  // kept here for the thread jobs.
+  uint32_t m_receiverThreads;
+  uint32_t m_parallelMinReceivers;
+  Ptr<ChannelThreadPool> m_threadPool;
+  uint32_t m_threadPoolSize;
+  std::vector<double> m_errorRates;
+  Vector m_parallelPosition;
+  bool   m_parallelIndexed;
+  double m_parallelLimitSquared;
+  
+  // Spatial index. Only devices that are not moving are binned.
+  SpatialIndexType m_spatialIndex;
+  bool   m_indexDirty;     // snapshot was rebuilt, rebuild index before next send
+  double m_cellSize;       // size of grid cells the index was built with (meters)
+  std::vector<GridCell> m_deviceCell;
+  std::map<GridCell, std::vector<uint32_t> > m_grid;
+  
+  // Slots of the devices of each node, indexed by node id
+  std::vector<std::vector<uint32_t> > m_nodeSlots;
+  
+  // Octree spatial index. Node 0 is the root.
+  static const uint32_t OCTREE_LEAF_SIZE = 8;
+  static const uint32_t OCTREE_MAX_DEPTH = 24;
+  bool   m_octreeDirty;
+  Time   m_octreeTime;       // snapshot time the drift was computed for
+  double m_octreeSlack;
+  double m_octreeDrift;      // farthest any device moved since the tree was built
+  std::vector<double> m_octreeX;   // positions the tree was built with
+  std::vector<double> m_octreeY;
+  std::vector<double> m_octreeZ;
+  std::vector<OctreeNode> m_octree;
+  std::vector<uint32_t> m_octreeSlots;
+  std::vector<uint32_t> m_octreeOctants;   // octant of each slot while building
+  std::vector<uint32_t> m_octreeSorted;
+  std::vector<uint32_t> m_octreeStack;
+  
+  // Per device transmission ranges
+  double m_txRange;          // range of the device sending now
+  bool   m_rangesDirty;      // a device was added or changed its range
+  double m_largestRange;     // largest range of any device
+  double m_largestRangeDefault;  // channel range m_largestRange was computed with
+  std::vector<uint32_t> m_candidates;
+  
+  // Verlet neighbor lists, indexed by sender slot.
+  double m_maxNodeSpeed;
+  double m_verletSkin;
+  bool   m_verletDirty;      // devices were added or jumped
+  std::vector<std::vector<uint32_t> > m_verletLists;
+  std::vector<double> m_verletLimits;   // limit (meters) each list was built for, < 0 if not built
+  std::vector<Time> m_verletTime;
+  
+  // Static topology. Receivers of each sender, indexed by sender slot,
+  // and the configuration they were computed with.
+  bool m_staticTopology;
+  bool m_staticDirty;      // devices were added or moved
+  std::vector<std::vector<StaticReceiver> > m_staticReceivers;
+  std::vector<bool> m_staticBuilt;
+  double m_staticRange;
+  bool   m_staticContentionEnabled;
+  double m_staticContentionRange;
+  ErrorModelType m_staticErrorModel;
+  double m_staticErrorRate;
+  
+  // Direct unicast. Slots of the devices with each address and of the
+  // devices that need to see every frame (promiscuous or pcap).
+  bool m_directUnicast;
+  bool m_directDirty;      // devices were added or changed
+  bool m_directSend;       // the current send only goes to the direct receivers
+  std::vector<Mac48Address> m_addresses;
+  std::vector<bool> m_listener;
+  std::map<Mac48Address, std::vector<uint32_t> > m_addressSlots;
+  std::vector<uint32_t> m_listenerSlots;
+  
+  // Batched delivery. Receivers and dropped receptions of the current
+  // transmission.
+  bool m_batchedDelivery;
+  std::vector<PendingDelivery> m_pending;
   
+  // Early receive drop
+  bool m_earlyReceiveDrop;
 };
 
 } // namespace ns3
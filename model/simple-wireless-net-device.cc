@@ -25,6 +25,10 @@
 #include "ns3/trace-source-accessor.h"
 #include "simple-wireless-net-device.h"
 #include "simple-wireless-channel.h"
+#ifdef NS3_MPI
+#include "ns3/mpi-interface.h"
+#include "ns3/mpi-receiver.h"
+#endif
 
 #include <netinet/in.h>  // needed for noth for protocol # in sniffer
 
@@ -35,119 +39,164 @@ namespace ns3 {
 NS_OBJECT_ENSURE_REGISTERED (SimpleWirelessNetDevice);
 
 //********************************************************
-//  TimestampTag used to store a timestamp with a packet
-//  when they are placed in the queue
+//  MacAddressTag used to store the source, destination
+//  and protocol of a packet while it is in the queue
 //********************************************************
-TypeId TimestampTag::GetTypeId (void)
+TypeId MacAddressTag::GetTypeId (void)
 {
-  static TypeId tid = TypeId ("TimestampTag")
+  static TypeId tid = TypeId ("MacAddressTag")
     .SetParent<Tag> ()
-    .AddConstructor<TimestampTag> ()
-    .AddAttribute ("Timestamp",
-                   "Some momentous point in time!",
-                   EmptyAttributeValue (),
-                   MakeTimeAccessor (&TimestampTag::GetTimestamp),
-                   MakeTimeChecker ())
+    .AddConstructor<MacAddressTag> ()
   ;
   return tid;
 }
 
-TypeId TimestampTag::GetInstanceTypeId (void) const
+TypeId MacAddressTag::GetInstanceTypeId (void) const
 {
   return GetTypeId ();
 }
 
-uint32_t TimestampTag::GetSerializedSize (void) const
+MacAddressTag::MacAddressTag ()
+  : m_protocol (0)
 {
-  return 8;
 }
 
-void TimestampTag::Serialize (TagBuffer i) const
+MacAddressTag::MacAddressTag (Mac48Address from, Mac48Address to, uint16_t protocol)
+  : m_from (from),
+    m_to (to),
+    m_protocol (protocol)
 {
-  int64_t t = m_timestamp.GetNanoSeconds ();
-  i.Write ((const uint8_t *)&t, 8);
 }
 
-void TimestampTag::Deserialize (TagBuffer i)
+uint32_t MacAddressTag::GetSerializedSize (void) const
 {
-  int64_t t;
-  i.Read ((uint8_t *)&t, 8);
-  m_timestamp = NanoSeconds (t);
+  return 6 + 6 + 2;
 }
 
-void TimestampTag::SetTimestamp (Time time)
+void MacAddressTag::Serialize (TagBuffer i) const
 {
-  m_timestamp = time;
+  uint8_t buffer[6];
+  m_from.CopyTo (buffer);
+  i.Write (buffer, 6);
+  m_to.CopyTo (buffer);
+  i.Write (buffer, 6);
+  i.WriteU16 (m_protocol);
 }
 
-Time TimestampTag::GetTimestamp (void) const
+void MacAddressTag::Deserialize (TagBuffer i)
 {
-  return m_timestamp;
+  uint8_t buffer[6];
+  i.Read (buffer, 6);
+  m_from.CopyFrom (buffer);
+  i.Read (buffer, 6);
+  m_to.CopyFrom (buffer);
+  m_protocol = i.ReadU16 ();
+}
+
+Mac48Address MacAddressTag::GetSource (void) const
+{
+  return m_from;
+}
+
+Mac48Address MacAddressTag::GetDestination (void) const
+{
+  return m_to;
+}
+
+uint16_t MacAddressTag::GetProtocol (void) const
+{
+  return m_protocol;
 }
 
-void TimestampTag::Print (std::ostream &os) const
+void MacAddressTag::Print (std::ostream &os) const
 {
-  os << "t=" << m_timestamp;
+  os << "from=" << m_from << " to=" << m_to << " protocol=" << m_protocol;
 }
 
 //********************************************************
 
 //********************************************************
-//  DestinationIdTag used to store a destination node id 
-//  with a packet when they are placed in the queue. 
-//  This is used by directional networks.
+//  QueueMetadataTag used to store the enqueue time and
+//  destination node id of a packet while it is in the queue
 //********************************************************
-TypeId DestinationIdTag::GetTypeId (void)
+TypeId QueueMetadataTag::GetTypeId (void)
 {
-  static TypeId tid = TypeId ("DestinationIdTag")
+  static TypeId tid = TypeId ("QueueMetadataTag")
     .SetParent<Tag> ()
-    .AddConstructor<DestinationIdTag> ()
+    .AddConstructor<QueueMetadataTag> ()
   ;
   return tid;
 }
 
-TypeId DestinationIdTag::GetInstanceTypeId (void) const
+TypeId QueueMetadataTag::GetInstanceTypeId (void) const
 {
   return GetTypeId ();
 }
 
-DestinationIdTag::DestinationIdTag ()
+QueueMetadataTag::QueueMetadataTag ()
+  : m_destnodeid (NO_DIRECTIONAL_NBR),
+    m_flags (0)
 {
 }
 
-DestinationIdTag::DestinationIdTag (uint32_t destId)
-  : m_destnodeid (destId)
+QueueMetadataTag::QueueMetadataTag (uint32_t destId)
+  : m_destnodeid (destId),
+    m_flags (0)
 {
 }
 
-uint32_t DestinationIdTag::GetSerializedSize (void) const
+uint32_t QueueMetadataTag::GetSerializedSize (void) const
 {
-  return 4;
+  return 16;
 }
 
-void DestinationIdTag::Serialize (TagBuffer i) const
+void QueueMetadataTag::Serialize (TagBuffer i) const
 {
+  i.WriteU64 (static_cast<uint64_t> (m_timestamp.GetNanoSeconds ()));
   i.WriteU32 (m_destnodeid);
+  i.WriteU8 (m_flags);
+  i.WriteU8 (0);
+  i.WriteU16 (0);
 }
 
-void DestinationIdTag::Deserialize (TagBuffer i)
+void QueueMetadataTag::Deserialize (TagBuffer i)
 {
+  m_timestamp = NanoSeconds (static_cast<int64_t> (i.ReadU64 ()));
   m_destnodeid = i.ReadU32 ();
+  m_flags = i.ReadU8 ();
+  i.ReadU8 ();
+  i.ReadU16 ();
+}
+
+void QueueMetadataTag::SetTimestamp (Time time)
+{
+  m_timestamp = time;
+  m_flags |= FLAG_TIMESTAMP;
+}
+
+Time QueueMetadataTag::GetTimestamp (void) const
+{
+  return m_timestamp;
+}
+
+bool QueueMetadataTag::HasTimestamp (void) const
+{
+  return (m_flags & FLAG_TIMESTAMP) != 0;
 }
 
-void DestinationIdTag::SetDestinationId (uint32_t id)
+void QueueMetadataTag::SetDestinationId (uint32_t id)
 {
   m_destnodeid = id;
 }
 
-uint32_t DestinationIdTag::GetDestinationId (void) const
+uint32_t QueueMetadataTag::GetDestinationId (void) const
 {
   return m_destnodeid;
 }
 
-void DestinationIdTag::Print (std::ostream &os) const
+void QueueMetadataTag::Print (std::ostream &os) const
 {
-  os << "t=" << m_destnodeid;
+  os << "t=" << m_timestamp << " dest=" << m_destnodeid;
 }
 
 //********************************************************
@@ -173,8 +222,20 @@ SimpleWirelessNetDevice::GetTypeId (void)
     .AddAttribute ("TxQueue", 
                    "A queue to use as the transmit queue in the device.",
                    PointerValue (),
-                   MakePointerAccessor (&SimpleWirelessNetDevice::m_queue),
+                   MakePointerAccessor (&SimpleWirelessNetDevice::SetQueue,
+                                        &SimpleWirelessNetDevice::GetQueue),
                    MakePointerChecker<Queue> ())
+    .AddAttribute ("MaxRange", 
+                   "Maximum transmission range (meters) of this device. Zero uses the MaxRange of the channel",
+                   DoubleValue (0.0),
+                   MakeDoubleAccessor (&SimpleWirelessNetDevice::SetMaxRange,
+                                       &SimpleWirelessNetDevice::GetMaxRange),
+                   MakeDoubleChecker<double> (0.0))
+    .AddAttribute ("MacAddressTagEnabled", 
+                   "Carry the addresses and protocol of queued packets in a packet tag instead of an Ethernet header. Ignored when pcap, the fixed neighbor list or a MacTx trace is used, or the queue is a PriorityQueue",
+                   BooleanValue (false),
+                   MakeBooleanAccessor (&SimpleWirelessNetDevice::m_macAddressTagEnabled),
+                   MakeBooleanChecker ())
     .AddAttribute ("FixedNeighborListEnabled", 
                    "Enabled or Disabled",
                    BooleanValue (false),
@@ -220,21 +281,69 @@ SimpleWirelessNetDevice::SimpleWirelessNetDevice ()
     m_node (0),
     m_mtu (0xffff),
     m_ifIndex (0),
+    m_currentProtocol (0),
+    m_currentNbrIndex (0),
     m_txMachineState (READY),
     m_queue(NULL),
     m_pktRcvTotal(0),
     m_pktRcvDrop(0),
     m_pcapEnabled(false),
     m_fixedNbrListEnabled(false),
-    m_nbrCount(0)
+    m_nbrCount(0),
+    m_maxRange(0.0),
+    m_macAddressTagEnabled(false),
+    m_queueNeedsHeader(false)
     
-{}
+{
+  m_phyRxBeginTrace.SetSinksChangedCallback (MakeCallback (&SimpleWirelessNetDevice::RxSinksChanged, this));
+  m_phyRxEndTrace.SetSinksChangedCallback (MakeCallback (&SimpleWirelessNetDevice::RxSinksChanged, this));
+  m_phyRxDropTrace.SetSinksChangedCallback (MakeCallback (&SimpleWirelessNetDevice::RxSinksChanged, this));
+}
+
+void
+SimpleWirelessNetDevice::ReceiveRemote (Ptr<Packet> packet)
+{
+  NS_LOG_FUNCTION (packet);
+  EthernetHeader header (false);
+  packet->RemoveHeader (header);
+  // The sending system does not drop remote receptions early, so the
+  // error model is always checked here
+  DoReceive (packet, header.GetLengthType (), header.GetDestination (), header.GetSource (), true);
+}
+
+bool
+SimpleWirelessNetDevice::IsReceiveCorrupt (Ptr<const Packet> packet)
+{
+  // The error model gets its own copy as in DoReceive since it may
+  // change the packet
+  return m_receiveErrorModel && m_receiveErrorModel->IsCorrupt (packet->Copy ());
+}
+
+void
+SimpleWirelessNetDevice::ReceiveDropped (Ptr<const Packet> packet, uint16_t protocol, 
+                                         Mac48Address to, Mac48Address from)
+{
+  NS_LOG_FUNCTION (packet << protocol << to << from);
+  m_phyRxBeginTrace (packet, from, to, protocol);
+  m_pktRcvTotal++;
+  m_phyRxDropTrace (packet, from, to, protocol);
+  m_pktRcvDrop++;
+}
 
 void 
-SimpleWirelessNetDevice::Receive (Ptr<Packet> packet, uint16_t protocol, 
+SimpleWirelessNetDevice::Receive (Ptr<const Packet> packet, uint16_t protocol, 
                             Mac48Address to, Mac48Address from)
 {
-  NS_LOG_FUNCTION (packet << protocol << to << from);
+  // When the channel drops receptions early the error model has
+  // already been checked
+  DoReceive (packet, protocol, to, from, !m_channel->GetEarlyReceiveDrop ());
+}
+
+void 
+SimpleWirelessNetDevice::DoReceive (Ptr<const Packet> packet, uint16_t protocol, 
+                                    Mac48Address to, Mac48Address from, bool checkErrorModel)
+{
+  NS_LOG_FUNCTION (packet << protocol << to << from << checkErrorModel);
   NetDevice::PacketType packetType;
   
   m_phyRxBeginTrace (packet, from, to, protocol);
@@ -242,11 +351,17 @@ SimpleWirelessNetDevice::Receive (Ptr<Packet> packet, uint16_t protocol,
   
   NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " receiving packet " << packet->GetUid () << "  from " << from << "  to " << to  );
 
-  if (m_receiveErrorModel && m_receiveErrorModel->IsCorrupt (packet) )
+  if (m_receiveErrorModel && checkErrorModel)
     {
-      m_phyRxDropTrace (packet, from, to, protocol);
-      m_pktRcvDrop++;
-      return;
+      // The error model may change the packet so give it a private copy
+      Ptr<Packet> copy = packet->Copy ();
+      if (m_receiveErrorModel->IsCorrupt (copy))
+        {
+          m_phyRxDropTrace (copy, from, to, protocol);
+          m_pktRcvDrop++;
+          return;
+        }
+      packet = copy;
     }
     
   if (m_pcapEnabled)
@@ -337,6 +452,10 @@ void
 SimpleWirelessNetDevice::SetAddress (Address address)
 {
   m_address = Mac48Address::ConvertFrom(address);
+  if (m_channel)
+    {
+      m_channel->DeviceChanged ();
+    }
 }
 Address 
 SimpleWirelessNetDevice::GetAddress (void) const
@@ -414,7 +533,10 @@ bool SimpleWirelessNetDevice::AddDirectionalNeighbors(std::map<uint32_t, Mac48Ad
   
   for ( std::map<uint32_t, Mac48Address> ::iterator it = nodesToAdd.begin(); it != nodesToAdd.end(); ++it)
   {
-     mDirectionalNbrs.insert(std::pair<uint32_t, Mac48Address>(it->first, it->second));
+     if (mDirectionalNbrs.insert(std::pair<uint32_t, Mac48Address>(it->first, it->second)).second)
+     {
+        mDirectionalNbrIds[it->second].insert(it->first);
+     }
      NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " added directional neighbor " << it->first << " mac Address " << it->second);
   }
   return true;
@@ -427,7 +549,10 @@ bool SimpleWirelessNetDevice::AddDirectionalNeighbor(uint32_t nodeid, Mac48Addre
   if (!m_fixedNbrListEnabled)
      return false;
      
-  mDirectionalNbrs.insert(std::pair<uint32_t, Mac48Address>(nodeid, macAddr));
+  if (mDirectionalNbrs.insert(std::pair<uint32_t, Mac48Address>(nodeid, macAddr)).second)
+  {
+     mDirectionalNbrIds[macAddr].insert(nodeid);
+  }
   NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " added directional neighbor " << nodeid << " mac Address " << macAddr);
   return true;
 }
@@ -440,6 +565,7 @@ void SimpleWirelessNetDevice::DeleteDirectionalNeighbors(std::set<uint32_t> node
      if (it2 != mDirectionalNbrs.end())
      {
         NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " deleted directional neighbor " << it2->first << " mac Address " << it2->second);
+        UnindexDirectionalNeighbor(it2->first, it2->second);
         mDirectionalNbrs.erase(it2);
      }
    }
@@ -451,10 +577,34 @@ void SimpleWirelessNetDevice::DeleteDirectionalNeighbor(uint32_t nodeid)
   if (it != mDirectionalNbrs.end())
   {
 	  NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " deleted directional neighbor " << nodeid << " mac Address " << it->second);
+     UnindexDirectionalNeighbor(nodeid, it->second);
      mDirectionalNbrs.erase(it);
   }
 }
 
+uint32_t SimpleWirelessNetDevice::FindDirectionalNeighbor(Mac48Address macAddr) const
+{
+  boost::unordered_map<Mac48Address, std::set<uint32_t>, Mac48AddressHash>::const_iterator it = mDirectionalNbrIds.find(macAddr);
+  if (it == mDirectionalNbrIds.end())
+  {
+     return NO_DIRECTIONAL_NBR;
+  }
+  return *it->second.begin();
+}
+
+void SimpleWirelessNetDevice::UnindexDirectionalNeighbor(uint32_t nodeid, Mac48Address macAddr)
+{
+  boost::unordered_map<Mac48Address, std::set<uint32_t>, Mac48AddressHash>::iterator it = mDirectionalNbrIds.find(macAddr);
+  if (it != mDirectionalNbrIds.end())
+  {
+     it->second.erase(nodeid);
+     if (it->second.empty())
+     {
+        mDirectionalNbrIds.erase(it);
+     }
+  }
+}
+
 //********************************************************************
 // Fixed Contention functions
 void SimpleWirelessNetDevice::ClearNbrCount(void)
@@ -469,6 +619,11 @@ void SimpleWirelessNetDevice::IncrementNbrCount(void)
   m_nbrCount++;
 }
 
+void SimpleWirelessNetDevice::SetNbrCount(int count)
+{
+  m_nbrCount = count;
+}
+
 int SimpleWirelessNetDevice::GetNbrCount(void)
 {
   return m_nbrCount;
@@ -489,35 +644,93 @@ SimpleWirelessNetDevice::TransmitStart (Ptr<Packet> p)
   m_txMachineState = BUSY;
   m_currentPkt = p;
   
+  // Get dest Id. This could be the default NO_DIRECTIONAL_NBR
+  QueueMetadataTag metadata;
+  p->PeekPacketTag (metadata);
+  uint32_t destId = metadata.GetDestinationId();
+  m_currentNbrs.clear ();
+  m_currentNbrIndex = 0;
+  
+  // A directional broadcast is queued once. It is sent to each of the
+  // directional neighbors in the list at the time it leaves the queue,
+  // each taking its own airtime. Without neighbors it is not sent and
+  // none of the traces fire.
+  if (destId == ALL_DIRECTIONAL_NBRS)
+  {
+     std::map<uint32_t, Mac48Address>::iterator  it;
+     for ( it = mDirectionalNbrs.begin(); it != mDirectionalNbrs.end(); ++it)
+     {
+        m_currentNbrs.push_back (it->first);
+     }
+     if (m_currentNbrs.empty ())
+     {
+        NS_LOG_INFO ("Node " << m_node->GetId() << " has no directional neighbors for broadcast packet");
+        Simulator::ScheduleNow (&SimpleWirelessNetDevice::TransmitComplete, this);
+        return;
+     }
+     destId = m_currentNbrs[m_currentNbrIndex++];
+  }
+  
   if (m_pcapEnabled)
   {
      m_promiscSnifferTrace (p);
   }
 
-  // Remove the timestamp tag. calculate queue latency and peg trace
-  TimestampTag timeEnqueued;
-  p->RemovePacketTag (timeEnqueued);
-  Time latency = Simulator::Now() - timeEnqueued.GetTimestamp();
-  m_QueueLatencyTrace(p, latency); 
-  NS_LOG_DEBUG (Simulator::Now() << " Getting packet with timestamp: " << timeEnqueued.GetTimestamp() );
+  // Remove the queue metadata tag. calculate queue latency and peg trace.
+  // There is no timestamp if no one was listening when it was queued.
+  p->RemovePacketTag (metadata);
+  if (metadata.HasTimestamp ())
+  {
+     Time latency = Simulator::Now() - metadata.GetTimestamp();
+     m_QueueLatencyTrace(p, latency); 
+     NS_LOG_DEBUG (Simulator::Now() << " Getting packet with timestamp: " << metadata.GetTimestamp() );
+  }
   
   // Remove ethernet header since it is not sent over the air
   // To this AFTER the queue latency trace in case the trace wants
-  // to use anything in the Ethernet header
-  EthernetHeader ethHeader;
-  p->RemoveHeader(ethHeader);
-  Mac48Address to = ethHeader.GetDestination ();
-  Mac48Address from = ethHeader.GetSource ();
-  uint16_t protocol = ethHeader.GetLengthType ();
+  // to use anything in the Ethernet header. Packets queued without
+  // the header carry the same fields in a tag.
+  Mac48Address to;
+  Mac48Address from;
+  uint16_t protocol;
+  MacAddressTag macTag;
+  if (m_macAddressTagEnabled && p->RemovePacketTag (macTag))
+  {
+     to = macTag.GetDestination ();
+     from = macTag.GetSource ();
+     protocol = macTag.GetProtocol ();
+  }
+  else
+  {
+     EthernetHeader ethHeader;
+     p->RemoveHeader(ethHeader);
+     to = ethHeader.GetDestination ();
+     from = ethHeader.GetSource ();
+     protocol = ethHeader.GetLengthType ();
+  }
   
+  m_currentProtocol = protocol;
+  m_currentTo = to;
+  m_currentFrom = from;
   
-  // Get dest Id tag. This could be the default NO_DIRECTIONAL_NBR
-  DestinationIdTag destIdTag;
-  p->RemovePacketTag (destIdTag);
-  uint32_t destId = destIdTag.GetDestinationId();
+  TransmitToDestination (destId);
+}
+
+void
+SimpleWirelessNetDevice::TransmitToDestination (uint32_t destId)
+{
+  NS_LOG_FUNCTION (this << destId);
+  
+  Ptr<Packet> p = m_currentPkt;
+  uint16_t protocol = m_currentProtocol;
+  Mac48Address to = m_currentTo;
+  Mac48Address from = m_currentFrom;
   
   Time txTime = Seconds (m_bps.CalculateTxTime (p->GetSize ()));
   
+  // Get the current neighbor count if the channel keeps it
+  m_channel->UpdateContention ();
+  
   // If we have a non-zero neighbor count then that means we are using contention and
   // the data rate changes. Note that when using contention, we will always have at least
   // a value of 1 for neighbor count because we count ourselves.
@@ -535,6 +748,8 @@ SimpleWirelessNetDevice::TransmitStart (Ptr<Packet> p)
   // there are not devices yet when the function is called then the first packet sent on the
   // channel by the device is what will cause the device to get init'd for contention. That is
   // after the device set the txTime so that first packet will be sent at full data rate.
+  // This does not happen when the channel keeps the neighbor counts (ContentionUpdateInterval
+  // is not zero) since the count is brought up to date above.
   if (m_nbrCount)
   {
      if (m_fixedNbrListEnabled)
@@ -570,6 +785,14 @@ SimpleWirelessNetDevice::TransmitComplete (void)
   // is empty, we are done, otherwise we need to start transmitting the
   // next packet.
   NS_ASSERT_MSG (m_txMachineState == BUSY, "Must be BUSY if transmitting");
+  
+  // Send a directional broadcast on to the next neighbor
+  if (m_currentNbrIndex < m_currentNbrs.size ())
+    {
+      TransmitToDestination (m_currentNbrs[m_currentNbrIndex++]);
+      return;
+    }
+  
   m_txMachineState = READY;
 
   NS_ASSERT_MSG (m_currentPkt != 0, "SimpleWirelessNetDevice::TransmitComplete(): m_currentPkt zero");
@@ -602,49 +825,54 @@ SimpleWirelessNetDevice::Send(Ptr<Packet> packet, const Address& dest, uint16_t
   // by the time we get here so we need to reconstruct it for for two reasons.
   // If queuing, add ethernet header to the packet in the queue so we can
   // retrieve the to, from and protocol. Also Ethernet header is
-  // needed so we can apply a pcap filter in priority queues
+  // needed so we can apply a pcap filter in priority queues.
+  // Unless nothing needs the header bytes, in which case the
+  // fields are carried in a tag while the packet is queued.
+  bool tagged = UseMacAddressTag ();
   EthernetHeader ethHeader;
-  ethHeader.SetSource (m_address);
-  ethHeader.SetDestination (to);
-  ethHeader.SetLengthType (protocolNumber);
-  packet->AddHeader (ethHeader);
+  if (!tagged)
+  {
+     ethHeader.SetSource (m_address);
+     ethHeader.SetDestination (to);
+     ethHeader.SetLengthType (protocolNumber);
+     packet->AddHeader (ethHeader);
+  }
   
   m_macTxTrace (packet);
   
-  // If directional networking is enabled, then we have to make a copy
-  // of this packet and enqueue it for each destination.
+  // If directional networking is enabled, then we have to find the
+  // directional neighbors the packet is for.
   if (m_fixedNbrListEnabled)
   {
-     std::map<uint32_t, Mac48Address>::iterator  it;
-     
      // Look up the dest address in the eth header of the packet.
      // This is necessary because in directional networks, the dest
      // could have been changed by the trace
-     packet->PeekHeader(ethHeader);
-     to = ethHeader.GetDestination();
+     if (!tagged)
+     {
+        packet->PeekHeader(ethHeader);
+        to = ethHeader.GetDestination();
+     }
      
      if (to.IsBroadcast())
      {
         NS_LOG_INFO ("Address " << to << " is broadcast");
-        // broadcast packet. Enqueue for all of our directional neighbors
-        for ( it = mDirectionalNbrs.begin(); it != mDirectionalNbrs.end(); ++it)
+        // broadcast packet. Enqueue once for all of our directional neighbors.
+        // It is sent to each of them when it is dequeued.
+        if (!mDirectionalNbrs.empty ())
         {
-           EnqueuePacket(packet->Copy(),m_address,to,protocolNumber,it->first);
-           NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " queueing packet to directional neighbor to node " << it->first);
+           EnqueuePacket(packet,m_address,to,protocolNumber,ALL_DIRECTIONAL_NBRS);
+           NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " queueing packet to " << mDirectionalNbrs.size () << " directional neighbors");
         }
      }
      else
      {
         NS_LOG_INFO ("Address " << to << " is NOT broadcast");
         // unicast packet. Find the directional neighbor with matching MAC address. (There might not be one)
-        for ( it = mDirectionalNbrs.begin(); it != mDirectionalNbrs.end(); ++it)
+        uint32_t nodeid = FindDirectionalNeighbor(to);
+        if (nodeid != NO_DIRECTIONAL_NBR)
         {
-           if (it->second == to)
-           {
-              EnqueuePacket(packet->Copy(),m_address,to,protocolNumber, it->first);
-              NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " found node " << it->first << " with matching Mac Address " << to);
-              break;
-           } 
+           EnqueuePacket(packet,m_address,to,protocolNumber, nodeid);
+           NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " found node " << nodeid << " with matching Mac Address " << to);
         }
      }
   }
@@ -670,55 +898,60 @@ SimpleWirelessNetDevice::SendFrom(Ptr<Packet> packet, const Address& source, con
   // by the time we get here so we need to reconstruct it for for two reasons.
   // If queuing, add ethernet header to the packet in the queue so we can
   // retrieve the to, from and protocol. Also Ethernet header is
-  // needed so we can apply a pcap filter in priority queues
+  // needed so we can apply a pcap filter in priority queues.
+  // Unless nothing needs the header bytes, in which case the
+  // fields are carried in a tag while the packet is queued.
+  bool tagged = UseMacAddressTag ();
   EthernetHeader ethHeader;
-  ethHeader.SetSource (from);
-  ethHeader.SetDestination (to);
-  ethHeader.SetLengthType (protocolNumber);
-  packet->AddHeader (ethHeader);
+  if (!tagged)
+  {
+     ethHeader.SetSource (from);
+     ethHeader.SetDestination (to);
+     ethHeader.SetLengthType (protocolNumber);
+     packet->AddHeader (ethHeader);
+  }
   
   m_macTxTrace (packet);
   
 
-  // If directional networking is enabled, then we have to make a copy
-  // of this packet and enqueue it for each destination.
+  // If directional networking is enabled, then we have to find the
+  // directional neighbors the packet is for.
   if (m_fixedNbrListEnabled)
   {
-     std::map<uint32_t, Mac48Address>::iterator  it;
-     
      // Look up the dest address in the eth header of the packet.
      // This is necessary because in directional networks, the dest
      // could have been changed by the trace
-     packet->PeekHeader(ethHeader);
-     to = ethHeader.GetDestination();
+     if (!tagged)
+     {
+        packet->PeekHeader(ethHeader);
+        to = ethHeader.GetDestination();
+     }
      
      if (to.IsBroadcast())
      {
         NS_LOG_INFO ("Address " << to << " is broadcast");
-        // broadcast packet. Enqueue for all of our directional neighbors
-        for ( it = mDirectionalNbrs.begin(); it != mDirectionalNbrs.end(); ++it)
+        // broadcast packet. Enqueue once for all of our directional neighbors.
+        // Note that we do not alter the to (mac address) here but instead specify
+        // that all neighbors are the destination. This gets carried with the packet
+        // in the queue metadata tag. When the packet is dequeued it is passed to the
+        // channel once for each neighbor with that neighbor's node id. At the channel
+        // it still appears as a broadcast packet but the channel only uses the dest id so it
+        // will know how to handle it from the perspective of directional networking.
+        if (!mDirectionalNbrs.empty ())
         {
-           // Note that we do not alter the to (mac address) here but instead specify
-           // the node id as the destination. This gets carried with the packet
-           // as a destination tag and passed to the channel. At the channel it still
-           // appears as a broadcast packet but the channel only uses the dest id so it
-           // will know how to handle it from the perspective of directional networking.
-           EnqueuePacket(packet->Copy(),from,to,protocolNumber,it->first);
-           NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " queueing packet to directional neighbor to node " << it->first);
+           EnqueuePacket(packet,from,to,protocolNumber,ALL_DIRECTIONAL_NBRS);
+           NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " queueing packet to " << mDirectionalNbrs.size () << " directional neighbors");
         }
      }
      else
      {
         NS_LOG_INFO ("Address " << to << " is NOT broadcast");
         // unicast packet. Find the directional neighbor with matching MAC address. (There might not be one)
-        for ( it = mDirectionalNbrs.begin(); it != mDirectionalNbrs.end(); ++it)
+        uint32_t nodeid = FindDirectionalNeighbor(to);
+        if (nodeid != NO_DIRECTIONAL_NBR)
         {
-           if (it->second == to)
-           {
-              EnqueuePacket(packet->Copy(),from,to,protocolNumber, it->first);
-              NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " found node " << it->first << " with matching Mac Address " << to);
-              break;
-           } 
+           EnqueuePacket(packet,from,to,protocolNumber, nodeid);
+           NS_LOG_INFO ("Node " << this->GetNode()->GetId() << " found node " << nodeid << " with matching Mac Address " << to);
         }
      }
   }
@@ -740,14 +973,20 @@ SimpleWirelessNetDevice::EnqueuePacket (Ptr<Packet> packet, Mac48Address from, M
   {
      // We are using queueing.
 
-     // Add a timestamp tag for latency
-     TimestampTag timestamp;
-     timestamp.SetTimestamp (Simulator::Now ());
-     packet->AddPacketTag (timestamp);
+     // Add one tag with the destination and, if anyone is listening
+     // for the queue latency, a timestamp
+     QueueMetadataTag metadata (destId);
+     if (!m_QueueLatencyTrace.IsEmpty ())
+     {
+        metadata.SetTimestamp (Simulator::Now ());
+     }
+     packet->AddPacketTag (metadata);
      
-     // add destination tag
-     DestinationIdTag idTag(destId);
-     packet->AddPacketTag (idTag);
+     // The packet has no Ethernet header. Keep its fields in a tag.
+     if (UseMacAddressTag ())
+     {
+        packet->AddPacketTag (MacAddressTag (from, to, protocolNumber));
+     }
           
      NS_LOG_DEBUG ("Queueing packet for destination " << destId << ". Protocol "<<  protocolNumber << " Current state is: " << m_txMachineState);
     
@@ -773,11 +1012,14 @@ SimpleWirelessNetDevice::EnqueuePacket (Ptr<Packet> packet, Mac48Address from, M
      {
        m_promiscSnifferTrace (packet);
      }
-     EthernetHeader ethHeader;
-     packet->RemoveHeader(ethHeader);
+     if (!UseMacAddressTag ())
+     {
+        EthernetHeader ethHeader;
+        packet->RemoveHeader(ethHeader);
+     }
      
-     m_TxBeginTrace (packet, m_address, to, protocolNumber);
      Time txTime = Seconds (m_bps.CalculateTxTime (packet->GetSize ()));
+     m_channel->UpdateContention ();
      // If we have a non-zero neighbor count then that means we are using contention and
      // the data rate changes. 
      if (m_nbrCount)
@@ -793,6 +1035,20 @@ SimpleWirelessNetDevice::EnqueuePacket (Ptr<Packet> packet, Mac48Address from, M
            NS_LOG_DEBUG ("Node " << m_node->GetId() << " txTime was increased to " << txTime << " because we have " << m_nbrCount << " neighbors. packet size is " << packet->GetSize ());
         }
      }   
+     
+     // Without a queue a directional broadcast goes to all the neighbors at once
+     if (destId == ALL_DIRECTIONAL_NBRS)
+     {
+        std::map<uint32_t, Mac48Address>::iterator  it;
+        for ( it = mDirectionalNbrs.begin(); it != mDirectionalNbrs.end(); ++it)
+        {
+           m_TxBeginTrace (packet, m_address, to, protocolNumber);
+           m_channel->Send (packet, protocolNumber, to, from, this, txTime, it->first);
+        }
+        return true;
+     }
+     
+     m_TxBeginTrace (packet, m_address, to, protocolNumber);
      m_channel->Send (packet, protocolNumber, to, from, this, txTime, destId);
      return true;
   }
@@ -810,6 +1066,23 @@ void
 SimpleWirelessNetDevice::SetNode (Ptr<Node> node)
 {
   m_node = node;
+  CreateMpiReceiver ();
+}
+
+// Packets from nodes on other systems come in through an MpiReceiver.
+// It is created when the node is set or, if MPI was enabled after
+// that, when the device is initialized at the start of the simulation.
+void
+SimpleWirelessNetDevice::CreateMpiReceiver (void)
+{
+#ifdef NS3_MPI
+  if (m_node && MpiInterface::IsEnabled () && (m_node->GetSystemId () == MpiInterface::GetSystemId ()) && !GetObject<MpiReceiver> ())
+    {
+      Ptr<MpiReceiver> mpiReceiver = CreateObject<MpiReceiver> ();
+      mpiReceiver->SetReceiveCallback (MakeCallback (&SimpleWirelessNetDevice::ReceiveRemote, this));
+      AggregateObject (mpiReceiver);
+    }
+#endif
 }
 bool 
 SimpleWirelessNetDevice::NeedsArp (void) const
@@ -822,6 +1095,13 @@ SimpleWirelessNetDevice::SetReceiveCallback (NetDevice::ReceiveCallback cb)
   m_rxCallback = cb;
 }
 
+void
+SimpleWirelessNetDevice::DoInitialize (void)
+{
+  CreateMpiReceiver ();
+  NetDevice::DoInitialize ();
+}
+
 void
 SimpleWirelessNetDevice::DoDispose (void)
 {
@@ -836,6 +1116,26 @@ void
 SimpleWirelessNetDevice::SetPromiscReceiveCallback (PromiscReceiveCallback cb)
 {
   m_promiscCallback = cb;
+  if (m_channel)
+    {
+      m_channel->DeviceChanged ();
+    }
+}
+
+bool
+SimpleWirelessNetDevice::NeedsAllFrames (void) const
+{
+  return m_pcapEnabled || !m_promiscCallback.IsNull () || !m_phyRxBeginTrace.IsEmpty ()
+         || !m_phyRxEndTrace.IsEmpty () || !m_phyRxDropTrace.IsEmpty ();
+}
+
+void
+SimpleWirelessNetDevice::RxSinksChanged (void)
+{
+  if (m_channel)
+    {
+      m_channel->DeviceChanged ();
+    }
 }
 
 bool
@@ -851,11 +1151,48 @@ SimpleWirelessNetDevice::SetDataRate (DataRate bps)
   m_bps = bps;
 }
 
+DataRate
+SimpleWirelessNetDevice::GetDataRate (void) const
+{
+  return m_bps;
+}
+
+void
+SimpleWirelessNetDevice::SetMaxRange (double range)
+{
+  NS_LOG_FUNCTION (this << range);
+  m_maxRange = range;
+  if (m_channel)
+    {
+      m_channel->DeviceChanged ();
+    }
+}
+
+double
+SimpleWirelessNetDevice::GetMaxRange (void) const
+{
+  return m_maxRange;
+}
+
+bool
+SimpleWirelessNetDevice::UseMacAddressTag (void) const
+{
+  // A MacTx sink may read or change the Ethernet header
+  return m_macAddressTagEnabled && !m_pcapEnabled && !m_fixedNbrListEnabled &&
+         !m_queueNeedsHeader && m_macTxTrace.IsEmpty ();
+}
+
 void
 SimpleWirelessNetDevice::SetQueue (Ptr<Queue> q)
 {
   NS_LOG_FUNCTION (this << q);
   m_queue = q;
+  
+  // The classifier of a priority queue needs the header bytes. Looked up
+  // by name since the pcap headers of the priority queue clash with
+  // PcapHelper.
+  static TypeId priorityQueue = TypeId::LookupByName ("ns3::PriorityQueue");
+  m_queueNeedsHeader = m_queue && m_queue->GetInstanceTypeId ().IsChildOf (priorityQueue);
 }
 
 Ptr<Queue>
@@ -872,6 +1209,10 @@ void SimpleWirelessNetDevice::EnablePcapAll (std::string filename)
 	Ptr<PcapFileWrapper> file = pcapHelper.CreateFile (filename, std::ios::out, PcapHelper::DLT_EN10MB);
 	pcapHelper.HookDefaultSink<SimpleWirelessNetDevice> (this, "PromiscSniffer", file);
 	m_pcapEnabled = true;
+	if (m_channel)
+	{
+	  m_channel->DeviceChanged ();
+	}
 }
 
 } // namespace ns3
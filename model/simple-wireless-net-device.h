@@ -22,6 +22,7 @@
 
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include "ns3/traced-callback.h"
 #include "ns3/net-device.h"
 #include "ns3/mac48-address.h"
@@ -34,6 +35,7 @@
 
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
+#include <boost/unordered_map.hpp>
 
 namespace ns3 {
 
@@ -42,13 +44,31 @@ class Node;
 class ErrorModel;
 
 #define NO_DIRECTIONAL_NBR  0xFFFFFFFF
+#define ALL_DIRECTIONAL_NBRS  0xFFFFFFFE
+
+// Hash of a MAC address for the directional neighbor index
+struct Mac48AddressHash
+{
+  std::size_t operator() (const Mac48Address &address) const
+  {
+    uint8_t buffer[6];
+    address.CopyTo (buffer);
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < 6; ++i)
+      {
+        value = (value << 8) | buffer[i];
+      }
+    return boost::hash<uint64_t> () (value);
+  }
+};
 
 
 //********************************************************
-//  TimestampTag used to store a timestamp with a packet
-//  when they are placed in the queue
+//  MacAddressTag used to store the source, destination
+//  and protocol of a packet while it is in the queue
+//  instead of adding an Ethernet header to it.
 //********************************************************
-class TimestampTag : public Tag {
+class MacAddressTag : public Tag {
 public:
   static TypeId GetTypeId (void);
   virtual TypeId GetInstanceTypeId (void) const;
@@ -56,26 +76,40 @@ public:
   virtual uint32_t GetSerializedSize (void) const;
   virtual void Serialize (TagBuffer i) const;
   virtual void Deserialize (TagBuffer i);
+  MacAddressTag();
+  
+  /**
+   *  Constructs a MacAddressTag with the given addresses and protocol
+   *
+   *  \param from source address
+   *  \param to destination address
+   *  \param protocol protocol number (Ethernet length/type)
+   */
+  MacAddressTag (Mac48Address from, Mac48Address to, uint16_t protocol);
 
   // these are our accessors to our tag structure
-  void SetTimestamp (Time time);
-  Time GetTimestamp (void) const;
+  Mac48Address GetSource (void) const;
+  Mac48Address GetDestination (void) const;
+  uint16_t GetProtocol (void) const;
 
   void Print (std::ostream &os) const;
 
 private:
-  Time m_timestamp;
+  Mac48Address m_from;
+  Mac48Address m_to;
+  uint16_t m_protocol;
 
-  // end class TimestampTag
+  // end class MacAddressTag
 };
 
 
 //********************************************************
-//  DestinationIdTag used to store a destination node id 
-//  with a packet when they are placed in the queue. 
-//  This is used by directional networks.
+//  QueueMetadataTag used to store the enqueue time and
+//  destination node id of a packet while it is in the
+//  queue. The layout is fixed at 16 bytes: time (8),
+//  destination id (4), flags (1) and 3 reserved bytes.
 //********************************************************
-class DestinationIdTag : public Tag {
+class QueueMetadataTag : public Tag {
 public:
   static TypeId GetTypeId (void);
   virtual TypeId GetInstanceTypeId (void) const;
@@ -83,25 +117,116 @@ public:
   virtual uint32_t GetSerializedSize (void) const;
   virtual void Serialize (TagBuffer i) const;
   virtual void Deserialize (TagBuffer i);
-  DestinationIdTag();
+  QueueMetadataTag();
   
   /**
-   *  Constructs a DestinationIdTag with the given node id
+   *  Constructs a QueueMetadataTag with the given node id and no timestamp
    *
    *  \param destId Id to use for the tag
    */
-  DestinationIdTag (uint32_t destId);
+  QueueMetadataTag (uint32_t destId);
 
   // these are our accessors to our tag structure
+  void SetTimestamp (Time time);
+  Time GetTimestamp (void) const;
+  bool HasTimestamp (void) const;
   void SetDestinationId (uint32_t destId);
   uint32_t GetDestinationId (void) const;
 
   void Print (std::ostream &os) const;
 
 private:
+  enum {
+    FLAG_TIMESTAMP = 0x01      // m_timestamp is set
+  };
+  
+  Time m_timestamp;
   uint32_t m_destnodeid;
+  uint8_t m_flags;
+
+  // end class QueueMetadataTag
+};
+
+
+//********************************************************
+//  TracedCallback that counts its sinks so the device
+//  can skip work for a trace nobody listens to. The trace
+//  source accessor calls these instead of the base class
+//  functions since it uses the type of the member. An
+//  optional callback is called when a sink is connected
+//  or disconnected.
+//********************************************************
+template <typename T1 = empty, typename T2 = empty, typename T3 = empty, typename T4 = empty>
+class CountedTracedCallback : public TracedCallback<T1, T2, T3, T4> {
+public:
+  CountedTracedCallback ()
+    : m_sinks (0)
+  {
+  }
+  
+  void ConnectWithoutContext (const CallbackBase &callback)
+  {
+    TracedCallback<T1, T2, T3, T4>::ConnectWithoutContext (callback);
+    m_sinks++;
+    SinksChanged ();
+  }
+  
+  void Connect (const CallbackBase &callback, std::string path)
+  {
+    TracedCallback<T1, T2, T3, T4>::Connect (callback, path);
+    m_sinks++;
+    SinksChanged ();
+  }
+  
+  // A disconnect of a sink that was never connected leaves the count
+  // too high, which only means the work for the trace is still done.
+  void DisconnectWithoutContext (const CallbackBase &callback)
+  {
+    TracedCallback<T1, T2, T3, T4>::DisconnectWithoutContext (callback);
+    if (m_sinks > 0)
+      {
+        m_sinks--;
+      }
+    SinksChanged ();
+  }
+  
+  void Disconnect (const CallbackBase &callback, std::string path)
+  {
+    TracedCallback<T1, T2, T3, T4>::Disconnect (callback, path);
+    if (m_sinks > 0)
+      {
+        m_sinks--;
+      }
+    SinksChanged ();
+  }
+  
+  /**
+   * \returns true if no sink is connected
+   */
+  bool IsEmpty (void) const
+  {
+    return m_sinks == 0;
+  }
+  
+  /**
+   * \param callback called after a sink is connected or disconnected
+   */
+  void SetSinksChangedCallback (Callback<void> callback)
+  {
+    m_sinksChanged = callback;
+  }
 
-  // end class DestinationIdTag
+private:
+  void SinksChanged (void)
+  {
+    if (!m_sinksChanged.IsNull ())
+      {
+        m_sinksChanged ();
+      }
+  }
+  
+  uint32_t m_sinks;
+  Callback<void> m_sinksChanged;
 };
 
 
@@ -122,7 +247,27 @@ public:
   static TypeId GetTypeId (void);
   SimpleWirelessNetDevice ();
 
-  void Receive (Ptr<Packet> packet, uint16_t protocol, Mac48Address to, Mac48Address from);
+  /**
+   * Receive a packet from the channel. The packet is shared by all the
+   * receivers of the transmission so it is copied before anything that
+   * may change it.
+   */
+  void Receive (Ptr<const Packet> packet, uint16_t protocol, Mac48Address to, Mac48Address from);
+  
+  /**
+   * Check the packet against the receive error model when the channel
+   * drops receptions early. The error model is given a copy of the packet.
+   *
+   * \returns true if the packet would be dropped by the error model
+   */
+  bool IsReceiveCorrupt (Ptr<const Packet> packet);
+  
+  /**
+   * Fire the traces for a reception dropped early by the channel at the
+   * time the packet would have arrived.
+   */
+  void ReceiveDropped (Ptr<const Packet> packet, uint16_t protocol, Mac48Address to, Mac48Address from);
+  
   void SetChannel (Ptr<SimpleWirelessChannel> channel);
 
   /**
@@ -146,6 +291,34 @@ public:
    */
   void SetDataRate (DataRate bps);
   
+  /**
+   * \returns the data rate used for transmission of packets
+   */
+  DataRate GetDataRate (void) const;
+  
+  /**
+   * Set the maximum transmission range of this device. Zero means the
+   * device uses the MaxRange of the channel.
+   *
+   * @param range the range in meters
+   */
+  void SetMaxRange (double range);
+  
+  /**
+   * \returns the maximum transmission range in meters, or zero if the
+   * device uses the MaxRange of the channel
+   */
+  double GetMaxRange (void) const;
+  
+  /**
+   * \returns true if queued packets carry their addresses and protocol in
+   * a MacAddressTag instead of an Ethernet header. This is the case if
+   * MacAddressTagEnabled is set, pcap and the fixed neighbor list are not
+   * enabled, nothing is connected to the MacTx trace and the queue is not
+   * a PriorityQueue, which needs the header bytes for its classifier.
+   */
+  bool UseMacAddressTag (void) const;
+  
     /**
    * Attach a queue to the PointToPointNetDevice.
    *
@@ -172,14 +345,29 @@ public:
   void DeleteDirectionalNeighbors(std::set<uint32_t> nodeids);
   void DeleteDirectionalNeighbor(uint32_t nodeid);
   
+  /**
+   * \returns the node id of the directional neighbor with the given MAC
+   * address, or NO_DIRECTIONAL_NBR if there is none. If more than one
+   * neighbor has the address the lowest node id is returned.
+   */
+  uint32_t FindDirectionalNeighbor(Mac48Address macAddr) const;
+  
   //******************************************
   // Fixed Contention functions
   void ClearNbrCount(void);
   void IncrementNbrCount(void);
+  void SetNbrCount(int count);
   int GetNbrCount(void);
 
   
   void EnablePcapAll(std::string filename);
+  
+  /**
+   * \returns true if the device has to see frames addressed to other
+   * hosts, which is when it has a promiscuous callback, pcap enabled or
+   * sinks connected to PhyRxBegin, PhyRxEnd or PhyRxDrop.
+   */
+  bool NeedsAllFrames (void) const;
 
   // inherited from NetDevice base class.
   virtual void SetIfIndex(const uint32_t index);
@@ -211,6 +399,7 @@ public:
   virtual bool SupportsSendFrom (void) const;
 
 protected:
+  virtual void DoInitialize (void);
   virtual void DoDispose (void);
 private:
   Ptr<SimpleWirelessChannel> m_channel;
@@ -223,6 +412,11 @@ private:
   Ptr<ErrorModel> m_receiveErrorModel;
   
   Ptr<Packet> m_currentPkt;
+  uint16_t m_currentProtocol;
+  Mac48Address m_currentTo;
+  Mac48Address m_currentFrom;
+  std::vector<uint32_t> m_currentNbrs;     // directional neighbors of a broadcast being sent
+  uint32_t m_currentNbrIndex;              // next neighbor in m_currentNbrs
   
     /**
    * Start Sending a Packet Down the Wire.
@@ -243,6 +437,42 @@ private:
    * of sending a packet out on the channel.
    */
   void TransmitComplete (void);
+  
+  /**
+   * Remove a directional neighbor from the MAC address index.
+   */
+  void UnindexDirectionalNeighbor (uint32_t nodeid, Mac48Address macAddr);
+  
+  /**
+   * Tell the channel when the sinks of a trace that needs every frame
+   * change, since it may stop delivering frames for other hosts.
+   */
+  void RxSinksChanged (void);
+  
+  /**
+   * Send the current packet to one destination. A directional broadcast
+   * is sent to each neighbor in turn, one airtime after the other.
+   */
+  void TransmitToDestination (uint32_t destId);
+  
+  /**
+   * Receive a packet sent by a node on another system in a distributed
+   * simulation. The packet carries the MAC fields in an Ethernet header.
+   */
+  void ReceiveRemote (Ptr<Packet> packet);
+  
+  /**
+   * Aggregate the MpiReceiver that passes packets from other systems to
+   * ReceiveRemote, if MPI is enabled and the node belongs to this system
+   */
+  void CreateMpiReceiver (void);
+  
+  /**
+   * Receive a packet, checking the receive error model first unless the
+   * channel has already done so.
+   */
+  void DoReceive (Ptr<const Packet> packet, uint16_t protocol, Mac48Address to, Mac48Address from,
+                  bool checkErrorModel);
 
   /**
    * Enumeration of the states of the transmit machine of the net device.
@@ -281,7 +511,7 @@ private:
    *
    * \see class CallBackTraceSource
    */
-  TracedCallback<Ptr<const Packet>, Mac48Address, Mac48Address, uint16_t > m_phyRxBeginTrace;
+  CountedTracedCallback<Ptr<const Packet>, Mac48Address, Mac48Address, uint16_t > m_phyRxBeginTrace;
 
   /**
    * The trace source fired when a packet ends the reception process from
@@ -289,7 +519,7 @@ private:
    *
    * \see class CallBackTraceSource
    */
-  TracedCallback<Ptr<const Packet>, Mac48Address, Mac48Address, uint16_t > m_phyRxEndTrace;
+  CountedTracedCallback<Ptr<const Packet>, Mac48Address, Mac48Address, uint16_t > m_phyRxEndTrace;
 
   /**
    * The trace source fired when the phy layer drops a packet it has received
@@ -299,7 +529,7 @@ private:
    *
    * \see class CallBackTraceSource
    */
-  TracedCallback<Ptr<const Packet>, Mac48Address, Mac48Address, uint16_t > m_phyRxDropTrace;
+  CountedTracedCallback<Ptr<const Packet>, Mac48Address, Mac48Address, uint16_t > m_phyRxDropTrace;
 
   /**
    * A trace source that emulates a promiscuous mode protocol sniffer connected
@@ -327,7 +557,7 @@ private:
    *
    * \see class CallBackTraceSource
    */
-  TracedCallback<Ptr<const Packet>, Time> m_QueueLatencyTrace;
+  CountedTracedCallback<Ptr<const Packet>, Time> m_QueueLatencyTrace;
   
   /**
    * The trace source fired when packets come into the "top" of the device
@@ -335,7 +565,7 @@ private:
    *
    * \see class CallBackTraceSource
    */
-  TracedCallback<Ptr<const Packet> > m_macTxTrace;
+  CountedTracedCallback<Ptr<const Packet> > m_macTxTrace;
   
   /**
    * The trace source fired for packets successfully received by the device
@@ -353,8 +583,15 @@ private:
   
   bool   m_fixedNbrListEnabled;
   std::map<uint32_t, Mac48Address> mDirectionalNbrs;
+  // Node ids of the directional neighbors by MAC address. Kept in step with mDirectionalNbrs.
+  boost::unordered_map<Mac48Address, std::set<uint32_t>, Mac48AddressHash> mDirectionalNbrIds;
   
   int  m_nbrCount;
+  
+  double m_maxRange;   // zero uses the channel's range
+  
+  bool   m_macAddressTagEnabled;
+  bool   m_queueNeedsHeader;   // the queue is a PriorityQueue
 };
 
 } // namespace ns3